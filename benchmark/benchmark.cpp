@@ -0,0 +1,870 @@
+//
+// benchmark.cpp
+// Standalone timing of TreeNode operations, e.g.: g++ -O2 -std=c++17 benchmark.cpp -o benchmark (libstdc++ runs the parallel algorithms on TBB: -ltbb)
+//
+
+#include "../treenode.h"
+
+#include <chrono>
+#include <cstdio>
+#include <execution>
+#include <functional>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+
+// Measures fn for n = n_begin, 2 * n_begin, ... n_end. The time per node is constant for linear and growing for superlinear algorithms.
+void Measure(char const* name, size_t n_begin, size_t n_end, function<size_t(size_t)> const& fn)
+{
+  printf("%s\n", name);
+  for (size_t n = n_begin; n <= n_end; n *= 2)
+  {
+    auto const start = chrono::steady_clock::now();
+    auto const node_num = fn(n);
+    auto const duration = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printf("  n: %9zu  nodes: %9zu  time: %10.2f ms  per node: %8.1f ns\n", n, node_num, duration, duration * 1e6 / node_num);
+    fflush(stdout);
+  }
+}
+
+
+// Root with n children, then every child gets its first child in sibling order: the bfs splice point is searched on a wide level.
+size_t AddFirstChildOnWideLevel(size_t n)
+{
+  TreeNode<int> root(0);
+  vector<TreeNode<int>*> children;
+  for (size_t i = 0; i < n; ++i)
+    children.push_back(root.add_child(1));
+
+  for (auto child : children)
+    child->add_child(2)->add_child(3);
+
+  return root.size();
+}
+
+// Same in reverse sibling order
+size_t AddFirstChildOnWideLevelReverse(size_t n)
+{
+  TreeNode<int> root(0);
+  vector<TreeNode<int>*> children;
+  for (size_t i = 0; i < n; ++i)
+    children.push_back(root.add_child(1));
+
+  for (auto it = children.rbegin(); it != children.rend(); ++it)
+    (*it)->add_child(2)->add_child(3);
+
+  return root.size();
+}
+
+// Depth-first construction (as a parser builds a tree): fan-out 8, depth is increased until n nodes are reached.
+void AddDfs(TreeNode<int>* node, size_t depth, size_t& budget)
+{
+  for (int i = 0; i < 8 && budget > 0; ++i)
+  {
+    --budget;
+    auto child = node->add_child(i);
+    if (depth > 1)
+      AddDfs(child, depth - 1, budget);
+  }
+}
+
+size_t AddChildDepthFirst(size_t n)
+{
+  TreeNode<int> root(0);
+  size_t depth = 1;
+  for (size_t m = 8; m < n; m *= 8)
+    ++depth;
+
+  auto budget = n;
+  AddDfs(&root, depth, budget);
+  return root.size();
+}
+
+// Runs of 16 children are added under the nodes of a 1024 long chain: add_child pays the ancestor size update for every node, add_children once per run.
+template<bool IsRun>
+size_t AddChildrenUnderDeepChain(size_t n)
+{
+  TreeNode<int> root(0);
+  vector<TreeNode<int>*> chain = { &root };
+  for (size_t i = 1; i < 1024; ++i)
+    chain.push_back(chain.back()->add_child(static_cast<int>(i)));
+
+  vector<int> const values(16, 1);
+  for (size_t i = 0; i * 16 < n; ++i)
+  {
+    auto const node = chain[chain.size() - 1 - i % 64];
+    if (IsRun)
+      node->add_children(values.begin(), values.end());
+    else
+      for (auto const value : values)
+        node->add_child(value);
+  }
+
+  return root.size();
+}
+
+// Burst of n add_child() under the nodes at the end of a 1024 deep chain, eager size updates or in a batch_update
+template<bool IsBatch>
+size_t AddChildBurstUnderDeepChain(size_t n)
+{
+  TreeNode<int> root(0);
+  vector<TreeNode<int>*> chain = { &root };
+  for (size_t i = 1; i < 1024; ++i)
+    chain.push_back(chain.back()->add_child(static_cast<int>(i)));
+
+  {
+    auto batch = IsBatch ? make_unique<TreeNode<int>::batch_update>() : nullptr;
+    for (size_t i = 0; i < n; ++i)
+      chain[chain.size() - 1 - (i >> 10) % 4]->add_child(1);
+  }
+
+  return root.size() - 1024;
+}
+
+// The source trees are depth-first built at the first call (warm-up)
+size_t CopyDepthFirstBuilt(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    it = roots.emplace(n, TreeNode<int>(0)).first;
+    size_t depth = 1;
+    for (size_t m = 8; m < n; m *= 8)
+      ++depth;
+
+    auto budget = n;
+    AddDfs(&it->second, depth, budget);
+  }
+
+  auto const copied = it->second;
+  return copied.size();
+}
+
+// Random recursive tree: the parent of the i-th node is one of the former nodes
+size_t BuildFromParentIndices(size_t n)
+{
+  vector<size_t> parents = { size_t(-1) };
+  vector<int> values = { 0 };
+  for (size_t i = 1; i < n; ++i)
+  {
+    parents.push_back(((i * 2654435761u) >> 16) % i);
+    values.push_back(static_cast<int>(i));
+  }
+
+  auto const root = TreeNode<int>::build(parents.begin(), parents.end(), values.begin());
+  return root.size();
+}
+
+// Random recursive tree under the first child of the root, it is built at the first call (warm-up) and removed at the second
+template<bool IsDeferred>
+size_t RemoveRandomSubtree(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1), 0 };
+    vector<int> values = { 0, 1 };
+    for (size_t i = 2; i < n; ++i)
+    {
+      parents.push_back(1 + (i * 2654435761u) % (i - 1));
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  TreeNode<int>::set_reclamation(IsDeferred ? TreeNode<int>::Reclamation::deferred : TreeNode<int>::Reclamation::immediate);
+  it->second.child_first()->remove();
+  TreeNode<int>::set_reclamation(TreeNode<int>::Reclamation::immediate);
+  return n;
+}
+// Random recursive tree under the first child of the root, it is built at the first call (warm-up), then moved below the second child (every level is shifted)
+template<bool IsGraft>
+size_t MoveRandomSubtree(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1), 0, 0, 1 };
+    vector<int> values = { 0, 1, 2, 3 };
+    for (size_t i = 4; i < n; ++i)
+    {
+      parents.push_back(3 + (i * 2654435761u) % (i - 3));
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  if (IsGraft)
+    root.child_last()->graft(root.child_first()->detach());
+  else
+    root.child_first()->move_to(root.child_last());
+
+  return n;
+}
+
+// Random recursive tree with random values, it is built at the first call (warm-up), then every sibling list is sorted in alternating order (the bfs chain is rebuilt once)
+size_t SortAllSegments(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>((i * 40503u) % 65536));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  static bool is_descending = false;
+  is_descending = !is_descending;
+  it->second.sort_all_segments([](int l, int r) { return is_descending ? r < l : l < r; });
+  return n;
+}
+// Paths of 3 keys are resolved through levels of 1024 children: linear search of the segments or the children index of the TKeyOf policy
+struct IntKeyOf
+{
+  int operator()(int value) const noexcept { return value; }
+};
+
+using KeyedNode = TreeNode<int, TreeNodePoolAllocator<int>, IntKeyOf>;
+
+TreeNode<int>* FindChild(TreeNode<int>* node, int key)
+{
+  for (auto child = node->child_first(); child; child = child->next())
+    if (child->get() == key)
+      return child;
+
+  return nullptr;
+}
+
+KeyedNode* FindChild(KeyedNode* node, int key) { return node->find_child(key); }
+
+template<typename Node>
+size_t ResolvePathInWideTree(size_t n)
+{
+  static auto& root = *new Node(0); // not destroyed: the pool of the nodes may be destroyed before it at exit
+  if (!root.child_first())
+  {
+    vector<int> values(1024);
+    for (int i = 0; i < 1024; ++i)
+      values[i] = i;
+
+    root.add_children(values.begin(), values.end());
+    for (auto key1 : { 3, 500, 1000 })
+    {
+      auto const node1 = FindChild(&root, key1);
+      node1->add_children(values.begin(), values.end());
+      for (auto key2 : { 7, 700 })
+        FindChild(node1, key2)->add_children(values.begin(), values.end());
+    }
+  }
+
+  size_t found = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    int const path[] = { i % 2 ? 500 : 1000, i % 3 ? 7 : 700, static_cast<int>(i % 1024) };
+    auto node = &root;
+    for (auto const key : path)
+      node = FindChild(node, key);
+
+    found += node != nullptr;
+  }
+
+  return found;
+}
+// n children are appended, then 4096 random positions are read by child_at(): O(index) walk or O(log k) by the sibling index
+template<bool IsIndexedSiblings>
+size_t ChildAtRandomPosition(size_t n)
+{
+  TreeNode<int, TreeNodePoolAllocator<int>, void, IsIndexedSiblings> root(0);
+  vector<int> const values(n, 1);
+  root.add_children(values.begin(), values.end());
+
+  size_t sum = 0;
+  for (size_t i = 0; i < 4096; ++i)
+    sum += root.child_at((i * 2654435761u) % n)->get();
+
+  return sum + n;
+}
+// Pages of 100 values at 64 random page positions of a random tree (built at the first call): std::next steps to the page, operator+ jumps by the subtree sizes / level widths
+template<bool IsDfs, bool IsJump>
+size_t PaginateRandomTree(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  size_t sum = 0;
+  for (size_t i = 0; i < 64; ++i)
+  {
+    auto const page_begin = (i * 2654435761u) % (n - 100);
+    auto const sum_page = [&](auto first)
+    {
+      first = IsJump ? first + page_begin : next(first, page_begin);
+      for (int j = 0; j < 100; ++j, ++first)
+        sum += *first;
+    };
+
+    if (IsDfs)
+      sum_page(root.begin_dfs());
+    else
+      sum_page(root.begin_bfs());
+  }
+
+  return sum > 0 ? 64 * 100 : 0;
+}
+
+// Dfs iteration forward and backward over a deep (a chain, every chain node has a leaf child) or a wide (sqrt(n) children with sqrt(n) children) tree, built at the first call.
+// Without threads a step climbs the parents / descends the last children, with dfs threading it follows one link.
+template<bool IsDfsThreaded, bool IsDeep>
+size_t IterateDfs(size_t n)
+{
+  using Node = TreeNode<int, TreeNodePoolAllocator<int>, void, false, IsDfsThreaded>;
+  static auto& roots = *new map<size_t, Node>; // not destroyed: the node pool of this size is created later
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    size_t k = 1;
+    while (k * k < n)
+      ++k;
+
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(IsDeep ? (i % 2 ? i - 1 : i - 2) : (i <= k ? 0 : 1 + (i - k - 1) / k));
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, Node::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  size_t sum = 0;
+  auto last = root.begin_dfs();
+  for (auto node = root.begin_dfs(), end = root.end_dfs(); node != end; ++node)
+  {
+    sum += *node;
+    last = node;
+  }
+
+  for (size_t i = 1; i < n; ++i)
+    sum += *--last;
+
+  return sum > 0 ? 2 * n : 0;
+}
+
+// 64 chains of n / 64 nodes under the root (built at the first call), one ++ from the end of every chain and one -- from the head of the next chain, 10 times:
+// without threads the dfs step climbs / descends a whole chain.
+template<bool IsDfsThreaded>
+size_t StepDfsAtChainEnds(size_t n)
+{
+  using Node = TreeNode<int, TreeNodePoolAllocator<int>, void, false, IsDfsThreaded>;
+  struct Chains
+  {
+    Node root;
+    vector<Node*> heads;
+    vector<Node*> tails;
+  };
+
+  static auto& trees = *new map<size_t, Chains>; // not destroyed: the node pool of this size is created later
+  auto it = trees.find(n);
+  if (it == trees.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(i <= 64 ? 0 : i - 64);
+      values.push_back(static_cast<int>(i));
+    }
+
+    auto& chains = trees[n];
+    chains.root = Node::build(parents.begin(), parents.end(), values.begin());
+    for (auto head = chains.root.child_first(); head; head = head->next())
+    {
+      chains.heads.push_back(head);
+      chains.tails.push_back(head);
+      while (chains.tails.back()->child_first())
+        chains.tails.back() = chains.tails.back()->child_first();
+    }
+    return n;
+  }
+
+  auto const& chains = it->second;
+  size_t sum = 0;
+  for (size_t repeat = 0; repeat < 10; ++repeat)
+    for (size_t i = 1; i < chains.heads.size(); ++i)
+    {
+      auto it_tail = chains.tails[i - 1]->begin_dfs();
+      sum += *++it_tail;
+      auto it_head = chains.heads[i]->begin_dfs();
+      sum += *--it_head;
+    }
+
+  return sum > 0 ? 10 * (chains.heads.size() - 1) * 2 : 0;
+}
+
+// Bfs of 64 random subtrees of a random tree (built at the first call): the bfs chain from the subtree root filtered by ancestry or subtree_bfs() which visits only the subtree
+template<bool IsSubtreeBfs>
+size_t BfsOfRandomSubtrees(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  size_t node_num = 0;
+  for (size_t i = 0; i < 64; ++i)
+  {
+    auto const node = root.nth_dfs((i * 2654435761u) % n);
+    if (IsSubtreeBfs)
+    {
+      for (auto const v : node->subtree_bfs())
+        node_num += v >= 0;
+    }
+    else
+    {
+      for (auto p = node; p; p = p->next_bfs())
+      {
+        auto ancestor = p;
+        while (ancestor && ancestor != node)
+          ancestor = ancestor->parent();
+
+        node_num += ancestor != nullptr;
+      }
+    }
+  }
+
+  return node_num;
+}
+
+// Search of the values under n / 256 in a random tree (built at the first call, the values grow along the paths): a full dfs iteration with a filter,
+// dfs iteration with skip_subtree() or visit_dfs() which prune the subtrees over the limit. The time is per node of the tree.
+enum class SearchMode { filter, skip_subtree, visit_dfs };
+
+template<SearchMode Mode>
+size_t PrunedSearch(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto const& root = it->second;
+  auto const limit = static_cast<int>(n / 256);
+  size_t found = 0;
+  switch (Mode)
+  {
+    case SearchMode::filter:
+      for (auto const v : root.subtree_dfs())
+        found += v < limit;
+      break;
+
+    case SearchMode::skip_subtree:
+      for (auto it_dfs = root.begin_dfs(), end = root.end_dfs(); it_dfs != end; )
+      {
+        if (*it_dfs >= limit)
+          it_dfs.skip_subtree();
+        else
+        {
+          ++found;
+          ++it_dfs;
+        }
+      }
+      break;
+
+    case SearchMode::visit_dfs:
+      root.visit_dfs([&](TreeNode<int> const& node)
+      {
+        if (node.get() >= limit)
+          return TreeNode<int>::DfsVisit::skip_subtree;
+
+        ++found;
+        return TreeNode<int>::DfsVisit::go_on;
+      });
+      break;
+  }
+
+  return found == static_cast<size_t>(limit) ? n : 0;
+}
+
+// A light operation on every value of a random or a chain tree (built at the first call): sequential dfs iteration, std::for_each(par) on the bfs iterators
+// (bidirectional, the library cannot split them) or tree_for_each(par) on subtree tasks
+enum class ForEachMode { sequential, std_for_each, tree_for_each };
+
+template<ForEachMode Mode, bool IsChain>
+size_t ParallelForEach(size_t n)
+{
+  static map<size_t, TreeNode<int>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(IsChain ? i - 1 : ((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, TreeNode<int>::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  auto const op = [](int& v) { v = v * 3 + 1; };
+  switch (Mode)
+  {
+    case ForEachMode::sequential: for (auto& v : root.subtree_dfs()) op(v); break;
+    case ForEachMode::std_for_each: for_each(execution::par, root.begin(), root.end(), op); break;
+    case ForEachMode::tree_for_each: tree_for_each(execution::par, root, op); break;
+  }
+
+  return n;
+}
+
+
+template<bool IsParallel, bool IsChain>
+size_t FoldUpSubtreeSums(size_t n)
+{
+  static map<size_t, pair<TreeNode<int>, vector<int64_t>>> roots;
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(IsChain ? i - 1 : ((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    roots.emplace(n, pair(TreeNode<int>::build(parents.begin(), parents.end(), values.begin()), vector<int64_t>(n)));
+    return n;
+  }
+
+  auto& [root, sums] = it->second;
+  auto const leaf = [](int v) { return int64_t(v); };
+  auto const combine = [](int64_t l, int64_t r) { return l + r; };
+  if constexpr (IsParallel)
+    fold_up(execution::par, root, leaf, combine, sums.begin());
+  else
+    fold_up(execution::seq, root, leaf, combine, sums.begin());
+
+  return n;
+}
+
+// Dashboard of a random tree (built at the first call, 16 top level nodes): 64 times a random value is modified, then the totals of the top level subtrees are read.
+// Without aggregate the subtrees are scanned, the sum policy updates the ancestors by subtract/combine, the max policy recombines them from their children.
+enum class TotalsMode { scan, sum, max };
+
+struct SumOfInt
+{
+  int64_t of(int v) const noexcept { return v; }
+  int64_t combine(int64_t l, int64_t r) const noexcept { return l + r; }
+  int64_t subtract(int64_t total, int64_t part) const noexcept { return total - part; }
+};
+
+struct MaxOfInt
+{
+  int of(int v) const noexcept { return v; }
+  int combine(int l, int r) const noexcept { return max(l, r); }
+};
+
+template<TotalsMode Mode>
+size_t SubtreeTotals(size_t n)
+{
+  using Aggregate = conditional_t<Mode == TotalsMode::scan, void, conditional_t<Mode == TotalsMode::sum, SumOfInt, MaxOfInt>>;
+  using Node = TreeNode<int, TreeNodePoolAllocator<int>, void, false, false, Aggregate>;
+  static auto& roots = *new map<size_t, Node>; // the pool of Node outlives it
+  auto it = roots.find(n);
+  if (it == roots.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(i <= 16 ? 0 : ((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i % 1000));
+    }
+
+    roots.emplace(n, Node::build(parents.begin(), parents.end(), values.begin()));
+    return n;
+  }
+
+  auto& root = it->second;
+  int64_t checksum = 0;
+  for (size_t i = 0; i < 64; ++i)
+  {
+    root.nth_dfs(1 + (i * 2654435761u) % (n - 1))->modify([i](int& v) { v = static_cast<int>(i % 1000); });
+    for (auto child = root.child_first(); child; child = child->next())
+    {
+      if constexpr (Mode == TotalsMode::scan)
+      {
+        for (auto const v : child->subtree_dfs())
+          checksum += v;
+      }
+      else
+        checksum += child->aggregate();
+    }
+  }
+
+  return checksum != 0 ? n : 0;
+}
+
+// Ancestry queries on a 64 branch tree of n nodes (built at the first call, the branches are 64 deep random trees): 4096 is_ancestor_of() of random pairs and 4096 lowest_common_ancestor() in the deepest branch.
+// The parents are walked without ancestry labels, the labels are compared and the jump pointers are followed with them.
+template<bool IsAncestryLabeled>
+size_t AncestryQueries(size_t n)
+{
+  using Node = TreeNode<int, TreeNodePoolAllocator<int>, void, false, false, void, IsAncestryLabeled>;
+  static auto& trees = *new map<size_t, pair<Node, vector<Node*>>>; // the pool of Node outlives it
+  auto it = trees.find(n);
+  if (it == trees.end())
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(i <= 64 ? 0 : (i % 8 == 0 ? i - 64 : ((i * 2654435761u) >> 16) % i));
+      values.push_back(static_cast<int>(i));
+    }
+
+    auto& [root, nodes] = trees.emplace(n, pair(Node::build(parents.begin(), parents.end(), values.begin()), vector<Node*>())).first->second;
+    copy(root.template begin_dfs<Node*>(), root.template end_dfs<Node*>(), back_inserter(nodes));
+    return n;
+  }
+
+  auto const& nodes = it->second.second;
+  size_t found = 0;
+  for (size_t i = 0; i < 4096; ++i)
+  {
+    auto const a = nodes[(i * 2654435761u) % n];
+    auto const b = nodes[(i * 40503u + 7) % n];
+    found += a->is_ancestor_of(b) || b->is_ancestor_of(a);
+  }
+
+  auto const deepest = *max_element(nodes.end() - 256, nodes.end(), [](auto l, auto r) { return l->get_depth() < r->get_depth(); });
+  for (size_t i = 0; i < 4096; ++i)
+    found += Node::lowest_common_ancestor(deepest, nodes[(i * 2654435761u) % n])->get_depth();
+
+  return found > 0 ? n : 0;
+}
+
+// Random tree of n nodes by add_child(), the ancestry labels are inserted into the gaps (and redistributed)
+template<bool IsAncestryLabeled>
+size_t AddChildRandomTree(size_t n)
+{
+  using Node = TreeNode<int, TreeNodePoolAllocator<int>, void, false, false, void, IsAncestryLabeled>;
+  Node root(0);
+  vector<Node*> nodes = { &root };
+  for (size_t i = 1; i < n; ++i)
+    nodes.push_back(nodes[((i * 2654435761u) >> 16) % i]->add_child(static_cast<int>(i)));
+
+  return root.size();
+}
+
+int main()
+{
+  Measure("add_child: first child on a wide level", 1 << 10, 1 << 16, AddFirstChildOnWideLevel);
+  Measure("add_child: first child on a wide level, reverse order", 1 << 10, 1 << 16, AddFirstChildOnWideLevelReverse);
+  Measure("add_child: depth-first construction", 1 << 12, 1 << 20, AddChildDepthFirst);
+  Measure("add_child: 16 children under deep nodes", 1 << 12, 1 << 18, AddChildrenUnderDeepChain<false>);
+  Measure("add_children: 16 children under deep nodes", 1 << 12, 1 << 18, AddChildrenUnderDeepChain<true>);
+  Measure("add_child: burst under deep nodes", 1 << 12, 1 << 18, AddChildBurstUnderDeepChain<false>);
+  Measure("add_child: burst under deep nodes, batch_update", 1 << 12, 1 << 18, AddChildBurstUnderDeepChain<true>);
+  Measure("build: random parent indices", 1 << 12, 1 << 20, BuildFromParentIndices);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+    CopyDepthFirstBuilt(n); // warm-up: the trees are built outside of the measurement
+
+  Measure("copy ctor: depth-first built tree", 1 << 12, 1 << 20, CopyDepthFirstBuilt);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    RemoveRandomSubtree<false>(n); // warm-up
+    RemoveRandomSubtree<true>(n);
+  }
+
+  Measure("remove: random subtree", 1 << 12, 1 << 20, RemoveRandomSubtree<false>);
+  Measure("remove: random subtree, deferred reclamation", 1 << 12, 1 << 20, RemoveRandomSubtree<true>);
+  printf("reclaim: %zu nodes\n", TreeNode<int>::reclaim());
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    MoveRandomSubtree<false>(n); // warm-up
+    MoveRandomSubtree<true>(n);
+  }
+
+  Measure("move_to: random subtree one level deeper", 1 << 12, 1 << 20, MoveRandomSubtree<false>);
+  Measure("detach + graft: random subtree one level deeper", 1 << 12, 1 << 20, MoveRandomSubtree<true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+    SortAllSegments(n); // warm-up
+
+  Measure("sort_all_segments: random tree", 1 << 12, 1 << 20, SortAllSegments);
+  ResolvePathInWideTree<TreeNode<int>>(1); // warm-up
+  ResolvePathInWideTree<KeyedNode>(1);
+  Measure("resolve: linear search of the children", 1 << 12, 1 << 16, ResolvePathInWideTree<TreeNode<int>>);
+  Measure("resolve: children index (TKeyOf)", 1 << 12, 1 << 16, ResolvePathInWideTree<KeyedNode>);
+  Measure("child_at: 4096 random positions among n children, walk", 1 << 12, 1 << 16, ChildAtRandomPosition<false>);
+  Measure("child_at: 4096 random positions among n children, indexed siblings", 1 << 12, 1 << 20, ChildAtRandomPosition<true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    PaginateRandomTree<true, false>(n); // warm-up
+    PaginateRandomTree<true, true>(n);
+    PaginateRandomTree<false, false>(n);
+    PaginateRandomTree<false, true>(n);
+  }
+
+  Measure("dfs page of 100: std::next", 1 << 12, 1 << 20, PaginateRandomTree<true, false>);
+  Measure("dfs page of 100: operator+", 1 << 12, 1 << 20, PaginateRandomTree<true, true>);
+  Measure("bfs page of 100: std::next", 1 << 12, 1 << 20, PaginateRandomTree<false, false>);
+  Measure("bfs page of 100: operator+", 1 << 12, 1 << 20, PaginateRandomTree<false, true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    IterateDfs<false, true>(n); // warm-up
+    IterateDfs<true, true>(n);
+    IterateDfs<false, false>(n);
+    IterateDfs<true, false>(n);
+  }
+
+  Measure("dfs iteration: deep tree", 1 << 12, 1 << 20, IterateDfs<false, true>);
+  Measure("dfs iteration: deep tree, dfs threading", 1 << 12, 1 << 20, IterateDfs<true, true>);
+  Measure("dfs iteration: wide tree", 1 << 12, 1 << 20, IterateDfs<false, false>);
+  Measure("dfs iteration: wide tree, dfs threading", 1 << 12, 1 << 20, IterateDfs<true, false>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    StepDfsAtChainEnds<false>(n); // warm-up
+    StepDfsAtChainEnds<true>(n);
+  }
+
+  Measure("dfs step at the ends of 64 chains", 1 << 12, 1 << 20, StepDfsAtChainEnds<false>);
+  Measure("dfs step at the ends of 64 chains, dfs threading", 1 << 12, 1 << 20, StepDfsAtChainEnds<true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    BfsOfRandomSubtrees<false>(n); // warm-up
+    BfsOfRandomSubtrees<true>(n);
+  }
+
+  Measure("bfs of 64 random subtrees: bfs chain filtered by ancestry", 1 << 12, 1 << 20, BfsOfRandomSubtrees<false>);
+  Measure("bfs of 64 random subtrees: subtree_bfs()", 1 << 12, 1 << 20, BfsOfRandomSubtrees<true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    PrunedSearch<SearchMode::filter>(n); // warm-up
+    PrunedSearch<SearchMode::skip_subtree>(n);
+    PrunedSearch<SearchMode::visit_dfs>(n);
+  }
+
+  Measure("search of the values under n / 256: dfs iteration with filter", 1 << 12, 1 << 20, PrunedSearch<SearchMode::filter>);
+  Measure("search of the values under n / 256: dfs iteration with skip_subtree()", 1 << 12, 1 << 20, PrunedSearch<SearchMode::skip_subtree>);
+  Measure("search of the values under n / 256: visit_dfs() with pruning", 1 << 12, 1 << 20, PrunedSearch<SearchMode::visit_dfs>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    ParallelForEach<ForEachMode::sequential, false>(n); // warm-up
+    ParallelForEach<ForEachMode::std_for_each, false>(n);
+    ParallelForEach<ForEachMode::tree_for_each, false>(n);
+    ParallelForEach<ForEachMode::sequential, true>(n);
+    ParallelForEach<ForEachMode::std_for_each, true>(n);
+    ParallelForEach<ForEachMode::tree_for_each, true>(n);
+    FoldUpSubtreeSums<false, false>(n);
+    FoldUpSubtreeSums<true, false>(n);
+    FoldUpSubtreeSums<false, true>(n);
+    FoldUpSubtreeSums<true, true>(n);
+  }
+
+  Measure("for each value of a random tree: sequential dfs", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::sequential, false>);
+  Measure("for each value of a random tree: std::for_each(par) on bfs iterators", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::std_for_each, false>);
+  Measure("for each value of a random tree: tree_for_each(par)", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::tree_for_each, false>);
+  Measure("for each value of a chain: sequential dfs", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::sequential, true>);
+  Measure("for each value of a chain: std::for_each(par) on bfs iterators", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::std_for_each, true>);
+  Measure("for each value of a chain: tree_for_each(par)", 1 << 12, 1 << 20, ParallelForEach<ForEachMode::tree_for_each, true>);
+  Measure("subtree sums of a random tree: fold_up(seq)", 1 << 12, 1 << 20, FoldUpSubtreeSums<false, false>);
+  Measure("subtree sums of a random tree: fold_up(par)", 1 << 12, 1 << 20, FoldUpSubtreeSums<true, false>);
+  Measure("subtree sums of a chain: fold_up(seq)", 1 << 12, 1 << 20, FoldUpSubtreeSums<false, true>);
+  Measure("subtree sums of a chain: fold_up(par)", 1 << 12, 1 << 20, FoldUpSubtreeSums<true, true>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    SubtreeTotals<TotalsMode::scan>(n); // warm-up
+    SubtreeTotals<TotalsMode::sum>(n);
+    SubtreeTotals<TotalsMode::max>(n);
+  }
+
+  Measure("64 x modify + top level subtree totals: scan", 1 << 12, 1 << 20, SubtreeTotals<TotalsMode::scan>);
+  Measure("64 x modify + top level subtree totals: sum aggregate (subtract)", 1 << 12, 1 << 20, SubtreeTotals<TotalsMode::sum>);
+  Measure("64 x modify + top level subtree totals: max aggregate (recombined)", 1 << 12, 1 << 20, SubtreeTotals<TotalsMode::max>);
+
+  for (size_t n = 1 << 12; n <= 1 << 20; n *= 2)
+  {
+    AncestryQueries<false>(n); // warm-up
+    AncestryQueries<true>(n);
+  }
+
+  Measure("4096 is_ancestor_of + 4096 lowest_common_ancestor: parent walk", 1 << 12, 1 << 20, AncestryQueries<false>);
+  Measure("4096 is_ancestor_of + 4096 lowest_common_ancestor: ancestry labels", 1 << 12, 1 << 20, AncestryQueries<true>);
+  Measure("add_child: random tree", 1 << 12, 1 << 20, AddChildRandomTree<false>);
+  Measure("add_child: random tree, ancestry labels", 1 << 12, 1 << 20, AddChildRandomTree<true>);
+
+  return 0;
+}
@@ -1,292 +1,3439 @@
 
-// #include <memory>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cassert>
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  #include <execution>
+#endif
+
+
+// Slab-backed pool of the blocks of TBlock with free-list recycling. Every type has its own pool (it is not shared by the types of the same size).
+// Blocks are carved from growing slabs and recycled through a thread local free list, which is refilled from / spilled to a shared free list in batches.
+// Slabs are given back only by release(), at once (arena reset), and only if none of the blocks is in use.
+template<typename TBlock>
+class TreeNodePool
+{
+private:
+  union _Block
+  {
+    _Block* next;
+    alignas(TBlock) unsigned char storage[sizeof(TBlock)];
+  };
+
+  static constexpr size_t _batch = 256;
+  static constexpr size_t _slab_size_max = 1 << 16;
+
+  // Trivially destructible: it stays usable after the thread local destructors, by the static ones as well (e.g. by the reclaimer of TreeNode)
+  struct _Cache
+  {
+    _Block* free = nullptr;
+    size_t count = 0;
+    size_t epoch = 0;
+    std::atomic<ptrdiff_t> live{ 0 }; // allocated minus deallocated blocks on the thread, it is written only by the thread
+    _Cache* prev_cache = nullptr;
+    _Cache* next_cache = nullptr;
+  };
+
+  struct _Shared
+  {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<_Block[]>> slabs;
+    _Block* free = nullptr;
+    size_t slab_size = 64;
+    std::atomic<size_t> epoch{ 0 };
+    _Cache* caches = nullptr; // of the running threads
+    ptrdiff_t live = 0; // of the exited threads
+  };
+
+  // Registers the cache of the thread, and spills it at the thread exit
+  struct _CacheSpill
+  {
+    _Cache* cache;
+
+    explicit _CacheSpill(_Cache* cache_) noexcept : cache(cache_)
+    {
+      auto& shared = _shared();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      cache->next_cache = shared.caches;
+      if (shared.caches)
+        shared.caches->prev_cache = cache;
+      shared.caches = cache;
+    }
+
+    ~_CacheSpill()
+    {
+      if (cache->free)
+        _spill(*cache, cache->count);
+
+      auto& shared = _shared();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      shared.live += cache->live.load(std::memory_order_relaxed);
+      if (cache->prev_cache)
+        cache->prev_cache->next_cache = cache->next_cache;
+      else
+        shared.caches = cache->next_cache;
+      if (cache->next_cache)
+        cache->next_cache->prev_cache = cache->prev_cache;
+    }
+  };
+
+  static _Shared& _shared() noexcept
+  {
+    static _Shared shared;
+    return shared;
+  }
+
+  static _Cache& _cache() noexcept
+  {
+    thread_local _Cache cache;
+    thread_local _CacheSpill const spill(&cache);
+
+    // Blocks of a released pool are dangling, they must be forgotten
+    auto const epoch = _shared().epoch.load(std::memory_order_acquire);
+    if (cache.epoch != epoch)
+    {
+      cache.free = nullptr;
+      cache.count = 0;
+      cache.epoch = epoch;
+    }
+    return cache;
+  }
+
+  static void _add_live(_Cache& cache, ptrdiff_t n) noexcept { cache.live.store(cache.live.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+  static void _refill(_Cache& cache)
+  {
+    auto& shared = _shared();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (!shared.free)
+    {
+      auto const n = shared.slab_size;
+      shared.slabs.emplace_back(new _Block[n]);
+      shared.slab_size = n < _slab_size_max ? n * 2 : n;
+
+      auto slab = shared.slabs.back().get();
+      for (size_t i = 0; i < n; ++i)
+        slab[i].next = i + 1 < n ? &slab[i + 1] : shared.free;
+      shared.free = slab;
+    }
+
+    for (size_t i = 0; i < _batch && shared.free; ++i)
+    {
+      auto block = shared.free;
+      shared.free = block->next;
+      block->next = cache.free;
+      cache.free = block;
+      ++cache.count;
+    }
+  }
+
+  static void _spill(_Cache& cache, size_t n) noexcept
+  {
+    auto& shared = _shared();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (cache.epoch != shared.epoch.load(std::memory_order_relaxed))
+      return;
+
+    for (; n > 0 && cache.free; --n, --cache.count)
+    {
+      auto block = cache.free;
+      cache.free = block->next;
+      block->next = shared.free;
+      shared.free = block;
+    }
+  }
+
+public:
+  static void* allocate()
+  {
+    auto& cache = _cache();
+    if (!cache.free)
+      _refill(cache);
+
+    auto block = cache.free;
+    cache.free = block->next;
+    --cache.count;
+    _add_live(cache, 1);
+    return block;
+  }
+
+  static void deallocate(void* p) noexcept
+  {
+    auto& cache = _cache();
+    auto block = static_cast<_Block*>(p);
+    block->next = cache.free;
+    cache.free = block;
+    _add_live(cache, -1);
+    if (++cache.count > 2 * _batch)
+      _spill(cache, _batch);
+  }
+
+  // Number of the blocks in use (allocated and not deallocated yet, on any thread)
+  static size_t size() noexcept
+  {
+    auto& shared = _shared();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    auto live = shared.live;
+    for (auto cache = shared.caches; cache; cache = cache->next_cache)
+      live += cache->live.load(std::memory_order_relaxed);
+
+    return static_cast<size_t>(live);
+  }
+
+  // Arena reset: frees every slab in bulk if none of the blocks is in use, otherwise it does nothing and returns false (the live nodes are never invalidated).
+  // The blocks of the other threads' free lists are dropped as well, so it must not run concurrently with allocate() or deallocate() of the same pool.
+  static bool release() noexcept
+  {
+    if (size() != 0)
+      return false;
+
+    auto& shared = _shared();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    shared.slabs.clear();
+    shared.free = nullptr;
+    shared.slab_size = 64;
+    shared.epoch.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+};
+
+
+// Stateless allocator of the TreeNode-s. Single objects come from the TreeNodePool of their type, arrays from the global operator new.
+template<typename T>
+class TreeNodePoolAllocator
+{
+public:
+  using value_type = T;
+
+  template<typename U>
+  struct rebind { using other = TreeNodePoolAllocator<U>; };
+
+  TreeNodePoolAllocator() = default;
+
+  template<typename U>
+  TreeNodePoolAllocator(TreeNodePoolAllocator<U> const&) noexcept {}
+
+  T* allocate(size_t n)
+  {
+    return static_cast<T*>(n == 1 ? TreeNodePool<T>::allocate() : ::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) noexcept
+  {
+    if (n == 1)
+      TreeNodePool<T>::deallocate(p);
+    else
+      ::operator delete(p);
+  }
+
+  // Arena reset of the pool of T (see TreeNodePool::release()): it affects only the nodes of the same TreeNode type, and only if all of them are destroyed
+  static bool release() noexcept { return TreeNodePool<T>::release(); }
+
+  template<typename U>
+  bool operator==(TreeNodePoolAllocator<U> const&) const noexcept { return true; }
+
+  template<typename U>
+  bool operator!=(TreeNodePoolAllocator<U> const&) const noexcept { return false; }
+};
+
+
+template<typename T, typename TAllocator = TreeNodePoolAllocator<T>, typename TKeyOf = void, bool IsIndexedSiblings = false, bool IsDfsThreaded = false, typename TAggregate = void, bool IsAncestryLabeled = false>
+class TreeNode;
+
+template<typename T, typename TValueType, typename TRefAndPointerBase, typename TNode, typename StepManager>
+class IteratorNodeTreeBase;
+
+template<typename T>
+class FlatTree;
+
+
+struct StepManagerSegment;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorSegment = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TNode, StepManagerSegment>;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorSegmentConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TNode const, StepManagerSegment>;
+
+
+struct StepManagerDfs;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorDfs = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TNode, StepManagerDfs>;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorDfsConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TNode const, StepManagerDfs>;
+
+
+
+struct StepManagerBfs;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorBfs = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TNode, StepManagerBfs>;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorBfsConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TNode const, StepManagerBfs>;
+
+
+template<typename T, typename TValueType, typename TRefAndPointerBase, typename TNode>
+class IteratorSubtreeBfsBase;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorSubtreeBfs = IteratorSubtreeBfsBase<T, T_or_NodePtr, T_or_NodePtr, TNode>;
+
+template<typename T, typename T_or_NodePtr = T, typename TNode = TreeNode<T>>
+using IteratorSubtreeBfsConst = IteratorSubtreeBfsBase<T, T_or_NodePtr, T_or_NodePtr const, TNode const>;
+
+
+// Iterator pair of a traversal for range-based for loops (see TreeNode::subtree_dfs())
+template<typename TIterator>
+struct TreeNodeRange
+{
+  TIterator first;
+  TIterator last;
+
+  TIterator begin() const noexcept { return first; }
+  TIterator end() const noexcept { return last; }
+};
+
+
+
+// Hash index of the children of a node by their TKeyOf{}(data) keys (see TreeNode::find_child()). The index is allocated for the nodes with children only.
+// Every child stores its entry: the entry is erased by its stored key, TKeyOf is called only by the insertions (it may throw there).
+template<typename TNode, typename T, typename TKeyOf>
+class TreeNodeKeyIndex
+{
+public:
+  using key_type = std::decay_t<decltype(std::declval<TKeyOf const&>()(std::declval<T const&>()))>;
+
+protected:
+  using _KeyMap = std::unordered_multimap<key_type, TNode*>;
+  using _KeyEntry = typename _KeyMap::value_type*; // the elements of the map are not moved by a rehash
+
+  std::unique_ptr<_KeyMap> _key_index{};
+  _KeyEntry _key_entry = nullptr; // of the node in the index of its parent
+
+  // The entry of the child is inserted, it is assigned to the child by _key_link() (the previous entry of the child is kept until then)
+  _KeyEntry _key_emplace(TNode* child)
+  {
+    if (!_key_index)
+      _key_index = std::make_unique<_KeyMap>();
+
+    try
+    {
+      return &*_key_index->emplace(TKeyOf{}(child->get()), child);
+    }
+    catch (...)
+    {
+      if (_key_index->empty())
+        _key_index.reset();
+
+      throw;
+    }
+  }
+
+  static void _key_link(TNode* child, _KeyEntry entry) noexcept { child->_key_entry = entry; }
+
+  void _key_insert(TNode* child) { _key_link(child, _key_emplace(child)); }
+
+  // An entry of _key_emplace() which is not linked
+  void _key_discard(_KeyEntry entry) noexcept
+  {
+    auto const range = _key_index->equal_range(entry->first);
+    for (auto it = range.first; it != range.second; ++it)
+      if (&*it == entry)
+      {
+        _key_index->erase(it);
+        break;
+      }
+
+    if (_key_index->empty())
+      _key_index.reset();
+  }
+
+  void _key_erase(TNode* child) noexcept
+  {
+    if (!child->_key_entry)
+      return;
+
+    _key_discard(child->_key_entry);
+    child->_key_entry = nullptr;
+  }
+
+  void _key_clear() noexcept { _key_index.reset(); }
+
+  // The children of r are adopted
+  void _key_adopt(TreeNodeKeyIndex& r) noexcept { _key_index = std::move(r._key_index); }
+
+  TNode* _key_find(key_type const& key) const
+  {
+    if (!_key_index)
+      return nullptr;
+
+    auto const it = _key_index->find(key);
+    return it != _key_index->end() ? it->second : nullptr;
+  }
+};
+
+// Without TKeyOf policy there is no index
+template<typename TNode, typename T>
+class TreeNodeKeyIndex<TNode, T, void>
+{
+public:
+  struct key_type {};
+
+protected:
+  using _KeyEntry = std::nullptr_t;
+
+  _KeyEntry _key_emplace(TNode*) noexcept { return nullptr; }
+  static void _key_link(TNode*, _KeyEntry) noexcept {}
+  void _key_insert(TNode*) noexcept {}
+  void _key_discard(_KeyEntry) noexcept {}
+  void _key_erase(TNode*) noexcept {}
+  void _key_clear() noexcept {}
+  void _key_adopt(TreeNodeKeyIndex&) noexcept {}
+  TNode* _key_find(key_type const&) const noexcept { return nullptr; }
+};
+
+// Order statistics of the children of a node (see TreeNode::child_at()): the children are the nodes of an implicit treap (in sibling order), every node stores its treap links and the count of its treap subtree.
+// The priorities are hashed from the addresses. Insertion after a sibling, erase, position and index are O(log k) expected.
+template<typename TNode, bool IsIndexedSiblings>
+class TreeNodeSiblingIndex
+{
+protected:
+  TNode* _rank_root = nullptr; // of the children
+  TNode* _rank_left = nullptr;
+  TNode* _rank_right = nullptr;
+  TNode* _rank_up = nullptr;
+  size_t _rank_count = 0;
+
+  static size_t _count(TNode const* node) noexcept { return node ? node->_rank_count : 0; }
+
+  static uint64_t _priority(TNode const* node) noexcept { return (reinterpret_cast<uintptr_t>(node) >> 3) * 0x9E3779B97F4A7C15ull; }
+
+  static void _recount(TNode* node) noexcept { node->_rank_count = 1 + _count(node->_rank_left) + _count(node->_rank_right); }
+
+  // Rotates node above its treap parent
+  void _rotate_up(TNode* node) noexcept
+  {
+    auto const up = node->_rank_up;
+    auto const grand = up->_rank_up;
+    if (up->_rank_left == node)
+    {
+      up->_rank_left = node->_rank_right;
+      if (up->_rank_left)
+        up->_rank_left->_rank_up = up;
+
+      node->_rank_right = up;
+    }
+    else
+    {
+      up->_rank_right = node->_rank_left;
+      if (up->_rank_right)
+        up->_rank_right->_rank_up = up;
+
+      node->_rank_left = up;
+    }
+
+    up->_rank_up = node;
+    node->_rank_up = grand;
+    if (!grand)
+      _rank_root = node;
+    else if (grand->_rank_left == up)
+      grand->_rank_left = node;
+    else
+      grand->_rank_right = node;
+
+    _recount(up);
+    _recount(node);
+  }
+
+  // The child is already linked after its previous sibling
+  void _rank_insert(TNode* child) noexcept
+  {
+    child->_rank_left = nullptr;
+    child->_rank_right = nullptr;
+    child->_rank_count = 1;
+
+    // As the in-order successor of the previous sibling
+    auto up = child->prev();
+    if (!up)
+    {
+      up = _rank_root;
+      while (up && up->_rank_left)
+        up = up->_rank_left;
+    }
+    else if (up->_rank_right)
+    {
+      up = up->_rank_right;
+      while (up->_rank_left)
+        up = up->_rank_left;
+    }
+
+    child->_rank_up = up;
+    if (!up)
+      _rank_root = child;
+    else if (up == child->prev())
+      up->_rank_right = child;
+    else
+      up->_rank_left = child;
+
+    for (auto p = up; p; p = p->_rank_up)
+      ++p->_rank_count;
+
+    while (child->_rank_up && _priority(child) > _priority(child->_rank_up))
+      _rotate_up(child);
+  }
+
+  void _rank_erase(TNode* child) noexcept
+  {
+    // Rotated down to have at most one treap child, which replaces it
+    while (child->_rank_left && child->_rank_right)
+      _rotate_up(_priority(child->_rank_left) > _priority(child->_rank_right) ? child->_rank_left : child->_rank_right);
+
+    auto const up = child->_rank_up;
+    auto const sub = child->_rank_left ? child->_rank_left : child->_rank_right;
+    if (sub)
+      sub->_rank_up = up;
+
+    if (!up)
+      _rank_root = sub;
+    else if (up->_rank_left == child)
+      up->_rank_left = sub;
+    else
+      up->_rank_right = sub;
+
+    for (auto p = up; p; p = p->_rank_up)
+      --p->_rank_count;
+  }
+
+  void _rank_clear() noexcept { _rank_root = nullptr; }
+
+  void _rank_adopt(TreeNodeSiblingIndex& r) noexcept
+  {
+    _rank_root = r._rank_root;
+    r._rank_root = nullptr;
+  }
+
+  size_t _rank_size() const noexcept { return _count(_rank_root); }
+
+  TNode* _rank_at(size_t index) const noexcept
+  {
+    auto node = _rank_root;
+    while (node)
+    {
+      auto const n_left = _count(node->_rank_left);
+      if (index == n_left)
+        return node;
+
+      if (index < n_left)
+        node = node->_rank_left;
+      else
+      {
+        index -= n_left + 1;
+        node = node->_rank_right;
+      }
+    }
+    return nullptr;
+  }
+
+  static size_t _rank_index_of(TNode const* child) noexcept
+  {
+    auto index = _count(child->_rank_left);
+    for (auto node = child; node->_rank_up; node = node->_rank_up)
+      if (node->_rank_up->_rank_right == node)
+        index += _count(node->_rank_up->_rank_left) + 1;
+
+    return index;
+  }
+};
+
+// Without the option the children are not indexed
+template<typename TNode>
+class TreeNodeSiblingIndex<TNode, false>
+{
+protected:
+  void _rank_insert(TNode*) noexcept {}
+  void _rank_erase(TNode*) noexcept {}
+  void _rank_clear() noexcept {}
+  void _rank_adopt(TreeNodeSiblingIndex&) noexcept {}
+  size_t _rank_size() const noexcept { return 0; }
+  TNode* _rank_at(size_t) const noexcept { return nullptr; }
+  static size_t _rank_index_of(TNode const*) noexcept { return 0; }
+};
+
+
+// Dfs threading (see TreeNode::next_dfs()): every node stores its dfs neighbours, which are spliced by the mutations
+template<typename TNode, bool IsDfsThreaded>
+class TreeNodeDfsThread
+{
+protected:
+  TNode* _prev_dfs = nullptr;
+  TNode* _next_dfs = nullptr;
+
+  static void _dfs_link(TNode* prev, TNode* next) noexcept
+  {
+    if (prev)
+      prev->_next_dfs = next;
+
+    if (next)
+      next->_prev_dfs = prev;
+  }
+
+  TNode* _dfs_prev() const noexcept { return _prev_dfs; }
+  TNode* _dfs_next() const noexcept { return _next_dfs; }
+};
+
+// Without the option the dfs neighbours are found by walking
+template<typename TNode>
+class TreeNodeDfsThread<TNode, false>
+{
+protected:
+  static void _dfs_link(TNode*, TNode*) noexcept {}
+  TNode* _dfs_prev() const noexcept { return nullptr; }
+  TNode* _dfs_next() const noexcept { return nullptr; }
+};
+
+
+// Subtree aggregate (see TreeNode::aggregate()): every node stores the combination of the TAggregate{}.of(data) values of its subtree, it is updated along the ancestors by the mutations.
+// TAggregate{}.combine(l, r) has to be associative and commutative (e.g. sum, min, max). With TAggregate{}.subtract(total, part) a removal or a value change is O(depth), otherwise the ancestors are recombined from their children.
+template<typename TNode, typename T, typename TAggregate>
+class TreeNodeAggregate
+{
+public:
+  using aggregate_type = std::decay_t<decltype(std::declval<TAggregate const&>().of(std::declval<T const&>()))>;
+
+private:
+  template<typename TPolicy, typename = void>
+  struct _HasSubtract : std::false_type {};
+
+  template<typename TPolicy>
+  struct _HasSubtract<TPolicy, decltype(void(std::declval<TPolicy const&>().subtract(std::declval<aggregate_type const&>(), std::declval<aggregate_type const&>())))> : std::true_type {};
+
+  // The part of the aggregates from node to the root is replaced by part_new (nullptr: removed)
+  static void _aggregate_replace(TNode* node, aggregate_type const& part, aggregate_type const* part_new, std::true_type)
+  {
+    for (; node; node = node->parent())
+    {
+      auto value = TAggregate{}.subtract(node->_aggregate, part);
+      node->_aggregate = part_new ? TAggregate{}.combine(value, *part_new) : std::move(value);
+    }
+  }
+
+  static void _aggregate_replace(TNode* node, aggregate_type const&, aggregate_type const*, std::false_type)
+  {
+    for (; node; node = node->parent())
+      _aggregate_recombine(node);
+  }
+
+protected:
+  aggregate_type _aggregate{};
+
+  static aggregate_type const& _aggregate_get(TNode const* node) noexcept { return node->_aggregate; }
+  static aggregate_type _aggregate_own(TNode const* node) { return TAggregate{}.of(node->get()); }
+
+  // Only the own value (a childless node)
+  static void _aggregate_reset(TNode* node) { node->_aggregate = _aggregate_own(node); }
+
+  // From the own value and the aggregates of the children
+  static void _aggregate_recombine(TNode* node)
+  {
+    auto value = _aggregate_own(node);
+    for (auto child = node->child_first(); child; child = child->next())
+      value = TAggregate{}.combine(value, child->_aggregate);
+
+    node->_aggregate = std::move(value);
+  }
+
+  // Combination of the [first, last] sibling run
+  static aggregate_type _aggregate_run(TNode const* first, TNode const* last)
+  {
+    auto value = first->_aggregate;
+    for (auto p = first; p != last; )
+    {
+      p = p->next();
+      value = TAggregate{}.combine(value, p->_aggregate);
+    }
+    return value;
+  }
+
+  static void _aggregate_combine(aggregate_type& value, aggregate_type const& part) { value = TAggregate{}.combine(value, part); }
+  static void _aggregate_combine(TNode* node, aggregate_type const& part) { _aggregate_combine(node->_aggregate, part); }
+
+  // A part is added under node (to the nodes from node to the root)
+  static void _aggregate_add(TNode* node, aggregate_type const& part)
+  {
+    for (; node; node = node->parent())
+      _aggregate_combine(node->_aggregate, part);
+  }
+
+  // The subtree of child is already unlinked from parent
+  static void _aggregate_remove(TNode* parent, TNode const* child) { _aggregate_replace(parent, child->_aggregate, nullptr, _HasSubtract<TAggregate>{}); }
+
+  // The own value of node is changed from own_old
+  static void _aggregate_changed(TNode* node, aggregate_type const& own_old)
+  {
+    auto const own = _aggregate_own(node);
+    _aggregate_replace(node, own_old, &own, _HasSubtract<TAggregate>{});
+  }
+
+  // The children of node are removed
+  static void _aggregate_clear(TNode* node)
+  {
+    auto const value = std::move(node->_aggregate);
+    _aggregate_reset(node);
+    _aggregate_replace(node->parent(), value, &node->_aggregate, _HasSubtract<TAggregate>{});
+  }
+
+  // The subtree of r is adopted by node, r keeps its own value only
+  static void _aggregate_adopt(TNode* node, TNode& r)
+  {
+    node->_aggregate = std::move(r._aggregate);
+    _aggregate_reset(&r);
+  }
+};
+
+// Without TAggregate policy there is no aggregate
+template<typename TNode, typename T>
+class TreeNodeAggregate<TNode, T, void>
+{
+public:
+  struct aggregate_type {};
+
+protected:
+  static aggregate_type const& _aggregate_get(TNode const*) noexcept { static aggregate_type const value; return value; }
+  static aggregate_type _aggregate_own(TNode const*) noexcept { return {}; }
+  static void _aggregate_reset(TNode*) noexcept {}
+  static void _aggregate_recombine(TNode*) noexcept {}
+  static aggregate_type _aggregate_run(TNode const*, TNode const*) noexcept { return {}; }
+  static void _aggregate_combine(aggregate_type&, aggregate_type const&) noexcept {}
+  static void _aggregate_combine(TNode*, aggregate_type const&) noexcept {}
+  static void _aggregate_add(TNode*, aggregate_type const&) noexcept {}
+  static void _aggregate_remove(TNode*, TNode const*) noexcept {}
+  static void _aggregate_changed(TNode*, aggregate_type const&) noexcept {}
+  static void _aggregate_clear(TNode*) noexcept {}
+  static void _aggregate_adopt(TNode*, TNode&) noexcept {}
+};
+
+
+// Ancestry labels (see TreeNode::is_ancestor_of()): the enter and exit tokens of the nodes form the Euler tour of the tree, their labels are kept in order by order maintenance (as the level labels).
+// Every node stores a skew-binary jump pointer to an ancestor (nullptr: the root), so the ancestor searches are O(log depth).
+template<typename TNode, bool IsAncestryLabeled>
+class TreeNodeAncestry
+{
+protected:
+  uint64_t _enter = 0;
+  uint64_t _exit = uint64_t(1) << 62; // a single root spans the label universe
+  TNode* _jump = nullptr;
+
+  // Enter or exit token of a node in the Euler tour
+  struct _Token
+  {
+    TNode* node;
+    bool is_exit;
+
+    explicit operator bool() const noexcept { return node != nullptr; }
+    bool operator==(_Token const& r) const noexcept { return node == r.node && is_exit == r.is_exit; }
+  };
+
+  static uint64_t& _label(_Token t) noexcept { return t.is_exit ? t.node->_exit : t.node->_enter; }
+
+  static _Token _token_next(_Token t) noexcept
+  {
+    if (!t.is_exit)
+      return t.node->_child_first ? _Token{ t.node->child_first(), false } : _Token{ t.node, true };
+
+    return t.node->_next ? _Token{ t.node->next(), false } : _Token{ t.node->_parent, true };
+  }
+
+  static _Token _token_prev(_Token t) noexcept
+  {
+    if (t.is_exit)
+      return t.node->_child_last ? _Token{ t.node->_child_last, true } : _Token{ t.node, false };
+
+    return t.node->_prev ? _Token{ t.node->_prev, true } : _Token{ t.node->_parent, false };
+  }
+
+  // The jump of a node from its parent's: the parent's jump of jump if the two jumps are equally long, otherwise the parent
+  static void _ancestry_jump(TNode* node) noexcept
+  {
+    auto const parent = node->_parent;
+    auto const jump = parent->_jump;
+    auto const jump_jump = jump ? jump->_jump : nullptr;
+    auto const depth_jump = jump ? jump->_depth : 0;
+    auto const depth_jump_jump = jump_jump ? jump_jump->_depth : 0;
+    if (parent->_depth - depth_jump == depth_jump - depth_jump_jump)
+      node->_jump = jump_jump;
+    else
+      node->_jump = parent->_parent ? parent : nullptr;
+  }
+
+  // The smallest aligned label range around the token whose density is below (1.6/2)^i is relabeled evenly (see TreeNode::_label_rebalance())
+  static void _ancestry_rebalance(_Token token, uint64_t label) noexcept
+  {
+    auto first = token;
+    auto last = token;
+    size_t n = 1;
+    uint64_t base = label;
+    uint64_t range = 1;
+    double capacity = 1.0;
+    for (int i = 1; i <= 62; ++i)
+    {
+      range <<= 1;
+      capacity *= 1.6;
+      base = label & ~(range - 1);
+      for (auto t = _token_prev(first); t && _label(t) >= base; t = _token_prev(first), ++n)
+        first = t;
+
+      for (auto t = _token_next(last); t && _label(t) - base < range; t = _token_next(last), ++n)
+        last = t;
+
+      if (static_cast<double>(n) < capacity)
+        break;
+    }
+
+    auto const gap = range / n;
+    for (auto t = first; n > 0; t = _token_next(t), --n)
+    {
+      _label(t) = base;
+      base += gap;
+    }
+  }
+
+  static bool _ancestry_contains(TNode const* node, TNode const* descendant) noexcept { return node->_enter <= descendant->_enter && descendant->_exit <= node->_exit; }
+  static TNode const* _ancestry_jump_of(TNode const* node) noexcept { return node->_jump; }
+
+  // The subtrees of the [first, last] sibling run (n tokens) are linked: their jumps are set, the tokens are labeled from the gap of the neighbour tokens, if it is exhausted, the labels are redistributed
+  static void _ancestry_link(TNode* first, TNode* last, size_t n) noexcept
+  {
+    auto const begin = _Token{ first, false };
+    auto const end = _Token{ last, true };
+    auto const prev = _token_prev(begin);
+    auto const next = _token_next(end);
+    auto const lo = prev ? _label(prev) + 1 : 0;
+    auto const hi = next ? _label(next) : TNode::_label_universe;
+    auto const gap = lo < hi ? (hi - lo) / (n + 1) : 0;
+    auto label = gap > 0 ? lo : (prev ? _label(prev) : hi);
+    for (auto t = begin; ; t = _token_next(t))
+    {
+      if (!t.is_exit)
+        _ancestry_jump(t.node);
+
+      if (gap > 0)
+        label += gap < TNode::_label_step ? gap : TNode::_label_step;
+
+      _label(t) = label;
+      if (t == end)
+        break;
+    }
+
+    // The run is collapsed onto the neighbour's label, the rebalance spreads it together with its surroundings
+    if (gap == 0)
+      _ancestry_rebalance(begin, label);
+  }
+
+  // The tree of root is labeled evenly, the jumps are set
+  static void _ancestry_relabel(TNode* root) noexcept
+  {
+    auto const gap = TNode::_label_universe / (2 * root->size() + 1);
+    auto const step = gap < TNode::_label_step ? gap : TNode::_label_step;
+    auto const end = _Token{ root, true };
+    uint64_t label = 0;
+    root->_jump = nullptr;
+    for (auto t = _Token{ root, false }; ; t = _token_next(t))
+    {
+      if (!t.is_exit && t.node != root)
+        _ancestry_jump(t.node);
+
+      _label(t) = label += step;
+      if (t == end)
+        break;
+    }
+  }
+
+  // The tokens of the descendants are relabeled evenly between the labels of node (the descendants are reordered)
+  static void _ancestry_respread(TNode* node) noexcept
+  {
+    if (!node->_child_first)
+      return;
+
+    auto const gap = (node->_exit - node->_enter) / (2 * node->size() - 1);
+    auto label = node->_enter;
+    for (auto t = _token_next(_Token{ node, false }); t.node != node; t = _token_next(t))
+      _label(t) = label += gap;
+  }
+
+  // The root r is moved into node
+  static void _ancestry_adopt(TNode* node, TNode const& r) noexcept
+  {
+    node->_enter = r._enter;
+    node->_exit = r._exit;
+  }
+};
+
+// Without the option the ancestors are walked
+template<typename TNode>
+class TreeNodeAncestry<TNode, false>
+{
+protected:
+  static bool _ancestry_contains(TNode const*, TNode const*) noexcept { return false; }
+  static TNode const* _ancestry_jump_of(TNode const*) noexcept { return nullptr; }
+  static void _ancestry_link(TNode*, TNode*, size_t) noexcept {}
+  static void _ancestry_relabel(TNode*) noexcept {}
+  static void _ancestry_respread(TNode*) noexcept {}
+  static void _ancestry_adopt(TNode*, TNode const&) noexcept {}
+};
+
+
+template<typename T, typename TAllocator, typename TKeyOf, bool IsIndexedSiblings, bool IsDfsThreaded, typename TAggregate, bool IsAncestryLabeled>
+class TreeNode
+  : private TreeNodeKeyIndex<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>, T, TKeyOf>
+  , private TreeNodeSiblingIndex<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>, IsIndexedSiblings>
+  , private TreeNodeDfsThread<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>, IsDfsThreaded>
+  , private TreeNodeAggregate<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>, T, TAggregate>
+  , private TreeNodeAncestry<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>, IsAncestryLabeled>
+{
+  using _KeyIndex = TreeNodeKeyIndex<TreeNode, T, TKeyOf>;
+  using _SiblingIndex = TreeNodeSiblingIndex<TreeNode, IsIndexedSiblings>;
+  using _DfsThread = TreeNodeDfsThread<TreeNode, IsDfsThreaded>;
+  using _Aggregate = TreeNodeAggregate<TreeNode, T, TAggregate>;
+  using _Ancestry = TreeNodeAncestry<TreeNode, IsAncestryLabeled>;
+  using _KeyEntry = typename _KeyIndex::_KeyEntry;
+  friend _KeyIndex;
+  friend _SiblingIndex;
+  friend _DfsThread;
+  friend _Aggregate;
+  friend _Ancestry;
+
+  template<typename, typename, typename, typename>
+  friend class IteratorSubtreeBfsBase;
+
+public:
+  // Key of the children index (TKeyOf policy)
+  using key_type = typename _KeyIndex::key_type;
+
+  // child_count() is O(1), child_at() and index_of() are O(log k) and the segment iterators jump by them
+  static constexpr bool is_indexed_siblings = IsIndexedSiblings;
+
+  // next_dfs() and prev_dfs() are O(1), the dfs iterators step by them
+  static constexpr bool is_dfs_threaded = IsDfsThreaded;
+
+  // Subtree aggregate of the TAggregate policy
+  using aggregate_type = typename _Aggregate::aggregate_type;
+
+  // is_ancestor_of() is O(1), lowest_common_ancestor() is O(log depth)
+  static constexpr bool is_ancestry_labeled = IsAncestryLabeled;
+
+  using allocator_type = typename std::allocator_traits<TAllocator>::template rebind_alloc<TreeNode>;
+
+private:
+  using _allocator_traits = std::allocator_traits<allocator_type>;
+
+  static_assert(std::is_empty<allocator_type>::value, "Only stateless allocators are supported.");
+
+  struct _Deleter
+  {
+    void operator()(TreeNode* node) const noexcept
+    {
+      allocator_type allocator;
+      _allocator_traits::destroy(allocator, node);
+      _allocator_traits::deallocate(allocator, node, 1);
+    }
+  };
+
+  using _NodePtr = std::unique_ptr<TreeNode, _Deleter>;
+
+  template<typename... Args>
+  static _NodePtr _make_node(Args&&... args)
+  {
+    allocator_type allocator;
+    auto node = _allocator_traits::allocate(allocator, 1);
+    try
+    {
+      _allocator_traits::construct(allocator, node, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+      _allocator_traits::deallocate(allocator, node, 1);
+      throw;
+    }
+    return _NodePtr(node);
+  }
+
+  // Selects the in-place constructor of the data
+  struct _EmplaceTag {};
+
+private:
+  T data{};
+
+  TreeNode* _parent = nullptr;
+
+  TreeNode* _prev = nullptr;
+  _NodePtr _next{};
+
+  _NodePtr _child_first{};
+  TreeNode* _child_last = nullptr;
+
+  TreeNode* _prev_bfs = nullptr;
+  TreeNode* _next_bfs = nullptr;
+
+  size_t _size = 1;
+  size_t _depth = 0;
+
+  template<typename U>
+  using _Allocator = typename std::allocator_traits<TAllocator>::template rebind_alloc<U>;
+
+  struct _LabelLess
+  {
+    bool operator()(TreeNode const* l, TreeNode const* r) const noexcept { return l->_label < r->_label; }
+  };
+
+  using _Parents = std::set<TreeNode*, _LabelLess, _Allocator<TreeNode*>>;
+
+  // Level index of the root: first and last node of every depth from 1 and the nodes which have children (in bfs order)
+  struct _Level
+  {
+    TreeNode* first = nullptr;
+    TreeNode* last = nullptr;
+    std::atomic<size_t> width{ 0 }; // _width_unknown after a subtree removal, it is recounted by the next query (it is published once, const queries may run concurrently)
+    _Parents parents;
+
+    _Level() = default;
+    _Level(_Level&& r) noexcept : first(r.first), last(r.last), width(r.width.load(std::memory_order_relaxed)), parents(std::move(r.parents)) {}
+  };
+  using _Levels = std::vector<_Level, _Allocator<_Level>>;
+
+  struct _LevelsDeleter
+  {
+    void operator()(_Levels* levels) const noexcept
+    {
+      _Allocator<_Levels> allocator;
+      std::allocator_traits<_Allocator<_Levels>>::destroy(allocator, levels);
+      std::allocator_traits<_Allocator<_Levels>>::deallocate(allocator, levels, 1);
+    }
+  };
+
+  using _LevelsPtr = std::unique_ptr<_Levels, _LevelsDeleter>;
+
+  static _LevelsPtr _make_levels(size_t n)
+  {
+    _Allocator<_Levels> allocator;
+    auto levels = std::allocator_traits<_Allocator<_Levels>>::allocate(allocator, 1);
+    try
+    {
+      std::allocator_traits<_Allocator<_Levels>>::construct(allocator, levels, n);
+    }
+    catch (...)
+    {
+      std::allocator_traits<_Allocator<_Levels>>::deallocate(allocator, levels, 1);
+      throw;
+    }
+    return _LevelsPtr(levels);
+  }
+
+  // Order label among the nodes of the same level. A root has no label, it owns the level index in its place (an unlinked child drops its label, see _unlink_sibling()).
+  union
+  {
+    _Levels* _levels = nullptr;
+    uint64_t _label;
+  };
+
+  // The previous level index of the root is destroyed
+  void _reset_levels(_LevelsPtr levels = _LevelsPtr{}) noexcept
+  {
+    _LevelsPtr const levels_old(_levels);
+    _levels = levels.release();
+  }
+
+public:
+  TreeNode() { _Aggregate::_aggregate_reset(this); }
+  TreeNode(const TreeNode& r) : data(r.data) { _copy(r, [](auto first, auto last, auto fn) { std::for_each(first, last, fn); }); }
+  TreeNode(TreeNode&& r) noexcept { _move(r); }
+  TreeNode& operator=(TreeNode const& r) { return *this = TreeNode(r); }
+  TreeNode& operator=(TreeNode&& r) noexcept
+  {
+    if (this != &r)
+    {
+      clear();
+      _move(r);
+    }
+    return *this;
+  }
+  ~TreeNode()
+  {
+    if (!_parent)
+    {
+      _flush_batch(); // no pending node may be destroyed
+      _reset_levels();
+    }
+
+    _destroy(std::move(_child_first));
+    _destroy(std::move(_next));
+  }
+
+  TreeNode(std::initializer_list<T> values)
+  {
+    auto it = values.begin();
+    if (it == values.end())
+      return;
+
+    data = *it;
+    _Aggregate::_aggregate_reset(this);
+    add_children(std::next(it), values.end());
+  }
+
+  explicit TreeNode(T const& d) : data(d) { _Aggregate::_aggregate_reset(this); }
+  explicit TreeNode(T && d) : data(std::forward<T>(d)) { _Aggregate::_aggregate_reset(this); }
+
+  template<typename... Args>
+  explicit TreeNode(_EmplaceTag, Args&&... args) : data(std::forward<Args>(args)...) { _Aggregate::_aggregate_reset(this); }
+
+  // Bulk construction in O(n): the i-th node's parent is the parent_first[i]-th node, the root is the only node whose parent index is out of range (e.g. -1).
+  // Siblings are ordered by their indices. Throws std::invalid_argument if the indices do not form a tree (empty input, no or multiple roots, cycles).
+  template<typename TParentIterator, typename TValueIterator>
+  static TreeNode build(TParentIterator parent_first, TParentIterator parent_last, TValueIterator value_first)
+  {
+    std::vector<size_t> parents;
+    std::vector<_NodePtr> nodes;
+    for (; parent_first != parent_last; ++parent_first, ++value_first)
+    {
+      parents.push_back(static_cast<size_t>(*parent_first));
+      nodes.push_back(_make_node(*value_first));
+    }
+
+    return _build(parents, nodes);
+  }
+
+  // Bulk construction from (parent index, value) rows (std::get<0>, std::get<1>), see build(parent_first, parent_last, value_first)
+  template<typename TRowIterator>
+  static TreeNode build(TRowIterator row_first, TRowIterator row_last)
+  {
+    std::vector<size_t> parents;
+    std::vector<_NodePtr> nodes;
+    for (; row_first != row_last; ++row_first)
+    {
+      parents.push_back(static_cast<size_t>(std::get<0>(*row_first)));
+      nodes.push_back(_make_node(std::get<1>(*row_first)));
+    }
+
+    return _build(parents, nodes);
+  }
+
+  // Get data
+  T const& get() const noexcept { return data; }
+  T& get() noexcept { return data; }
+
+  // Modifies the data by fn(data), the key index of the parent and the aggregates of the ancestors are updated (the key and the aggregated fields must be changed by it, not through get())
+  template<typename TModify>
+  void modify(TModify&& fn)
+  {
+    _flush_batch();
+    if (_parent)
+      _parent->_key_erase(this);
+
+    auto const own = _Aggregate::_aggregate_own(this);
+    try
+    {
+      std::forward<TModify>(fn)(data);
+    }
+    catch (...)
+    {
+      _Aggregate::_aggregate_changed(this, own);
+      if (_parent)
+        _parent->_key_insert(this);
+
+      throw;
+    }
+
+    _Aggregate::_aggregate_changed(this, own);
+    if (_parent)
+      _parent->_key_insert(this);
+  }
+
+  template<typename TModify>
+  static void modify(TreeNode* node, TModify&& fn) { node->modify(std::forward<TModify>(fn)); }
+
+  // Combination of the TAggregate{}.of(data) values of the subtree, O(1) (TAggregate policy is required)
+  aggregate_type const& aggregate() const noexcept
+  {
+    static_assert(!std::is_void<TAggregate>::value, "aggregate() requires the TAggregate policy!");
+    _flush_batch();
+    return _Aggregate::_aggregate_get(this);
+  }
+
+  // Segment navigation
+  inline TreeNode* prev() noexcept { return _prev; }
+  inline TreeNode const* prev() const noexcept { return _prev; }
+
+  inline TreeNode* next() noexcept { return _next.get(); }
+  inline TreeNode const* next() const noexcept { return _next.get(); }
+
+  // Subsegment navigation
+  inline TreeNode* parent() { return _parent; }
+  inline TreeNode const* parent() const { return _parent; }
+
+  inline TreeNode* child_first() noexcept { return _child_first.get(); }
+  inline TreeNode const* child_first() const noexcept { return _child_first.get(); }
+
+  inline TreeNode* child_last() noexcept { return _child_last; }
+  inline TreeNode const* child_last() const noexcept { return _child_last; }
+
+  // Breadth first search
+  inline TreeNode * prev_bfs() noexcept { return _prev_bfs; }
+  inline TreeNode const* prev_bfs() const noexcept { return _prev_bfs; }
+
+  inline TreeNode * next_bfs() noexcept { return _next_bfs; }
+  inline TreeNode const* next_bfs() const noexcept { return _next_bfs; }
+
+  // Depth first search: O(1) with dfs threading (IsDfsThreaded), otherwise the next node is found by climbing the parents, the previous one by descending the last children
+  TreeNode const* prev_dfs() const noexcept
+  {
+    if (IsDfsThreaded)
+      return this->_dfs_prev();
+
+    if (!_prev)
+      return _parent;
+
+    return _prev->_dfs_last();
+  }
+
+  TreeNode* prev_dfs() noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->prev_dfs()); // Scott Meyers
+  }
+
+  TreeNode const* next_dfs() const noexcept
+  {
+    if (IsDfsThreaded)
+      return this->_dfs_next();
+
+    return _child_first ? child_first() : _dfs_end();
+  }
+
+  TreeNode* next_dfs() noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->next_dfs()); // Scott Meyers
+  }
+
+  // The next node in dfs order after the subtree (nullptr on the root's subtree), O(depth)
+  TreeNode const* next_dfs_skip() const noexcept { return _dfs_end(); }
+  TreeNode* next_dfs_skip() noexcept { return _dfs_end(); }
+
+  size_t get_depth() const noexcept { return _depth; }
+
+  // Whether node is in the subtree of this node (a node is its own ancestor), the nodes are in the same tree. O(1) with ancestry labels (IsAncestryLabeled), otherwise the parents of node are walked.
+  bool is_ancestor_of(TreeNode const* node) const noexcept
+  {
+    if (IsAncestryLabeled)
+      return _Ancestry::_ancestry_contains(this, node);
+
+    if (node->_depth < _depth)
+      return false;
+
+    while (node->_depth > _depth)
+      node = node->_parent;
+
+    return node == this;
+  }
+
+  // The deepest common ancestor of the nodes of the same tree. O(log depth) with ancestry labels: the jump pointers are followed while they stay under the common ancestor, otherwise O(depth).
+  static TreeNode const* lowest_common_ancestor(TreeNode const* a, TreeNode const* b) noexcept
+  {
+    if (IsAncestryLabeled)
+    {
+      while (!a->is_ancestor_of(b))
+      {
+        assert(("The nodes are in different trees!", a->_parent));
+        auto const jump = _Ancestry::_ancestry_jump_of(a);
+        a = jump && !jump->is_ancestor_of(b) ? jump : a->_parent;
+      }
+      return a;
+    }
+
+    while (a->_depth > b->_depth)
+      a = a->_parent;
+
+    while (b->_depth > a->_depth)
+      b = b->_parent;
+
+    while (a != b)
+    {
+      assert(("The nodes are in different trees!", a->_parent));
+      a = a->_parent;
+      b = b->_parent;
+    }
+    return a;
+  }
+
+  static TreeNode* lowest_common_ancestor(TreeNode* a, TreeNode* b) noexcept
+  {
+    return const_cast<TreeNode*>(lowest_common_ancestor(static_cast<TreeNode const*>(a), static_cast<TreeNode const*>(b))); // Scott Meyers
+  }
+
+  size_t size() const noexcept
+  {
+    _flush_batch();
+    return _size;
+  }
+  size_t size_segment() const noexcept { return child_count(); }
+
+  // Number of the children, O(1) with indexed siblings, O(k) otherwise
+  size_t child_count() const noexcept
+  {
+    if (IsIndexedSiblings)
+      return this->_rank_size();
+
+    size_t n = 0;
+    for (auto p = child_first(); p; p = p->next())
+      ++n;
+
+    return n;
+  }
+
+  // The index-th child (nullptr if index >= child_count()), O(log k) with indexed siblings, O(index) otherwise
+  TreeNode const* child_at(size_t index) const noexcept
+  {
+    if (IsIndexedSiblings)
+      return this->_rank_at(index);
+
+    auto p = child_first();
+    for (; p && index > 0; --index)
+      p = p->next();
+
+    return p;
+  }
+
+  TreeNode* child_at(size_t index) noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->child_at(index)); // Scott Meyers
+  }
+
+  // Position of the child among the children of this node, O(log k) with indexed siblings, O(index) otherwise
+  size_t index_of(TreeNode const* child) const noexcept
+  {
+    assert(("Not a child of the node!", child->_parent == this));
+    if (IsIndexedSiblings)
+      return _SiblingIndex::_rank_index_of(child);
+
+    size_t index = 0;
+    for (auto p = child->prev(); p; p = p->prev())
+      ++index;
+
+    return index;
+  }
+
+
+  // Order statistics of the traversals. The positions count from this node in the order of its dfs/bfs iteration (begin_dfs()/begin()), so on the root they are the positions in the tree.
+
+  // The node n positions after (n < 0: before) this node in dfs order, nullptr past the last node. Whole subtrees are skipped by their sizes, O(depth * fan-out).
+  TreeNode const* advance_dfs(ptrdiff_t n) const noexcept
+  {
+    _flush_batch();
+    auto node = this;
+    if (n >= 0)
+    {
+      auto k = static_cast<size_t>(n);
+      while (node && k >= node->_size)
+      {
+        k -= node->_size;
+        while (node && !node->next())
+          node = node->_parent;
+
+        node = node ? node->next() : nullptr;
+      }
+
+      assert(("Out of range!", node || k == 0));
+      return node ? node->_nth_in_subtree(k) : nullptr;
+    }
+
+    for (auto k = static_cast<size_t>(-n); k > 0; )
+    {
+      auto const prev = node->prev();
+      if (!prev)
+      {
+        node = node->_parent;
+        assert(("Out of range!", node));
+        --k;
+      }
+      else if (k <= prev->_size)
+        return prev->_nth_in_subtree(prev->_size - k);
+      else
+      {
+        k -= prev->_size;
+        node = prev;
+      }
+    }
+    return node;
+  }
+
+  TreeNode* advance_dfs(ptrdiff_t n) noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->advance_dfs(n)); // Scott Meyers
+  }
+
+  // The k-th node in dfs order (the subtree of this node is the first size() nodes), nullptr past the last node
+  TreeNode const* nth_dfs(size_t k) const noexcept { return advance_dfs(static_cast<ptrdiff_t>(k)); }
+  TreeNode* nth_dfs(size_t k) noexcept { return advance_dfs(static_cast<ptrdiff_t>(k)); }
+
+  // Position of node in dfs order (node is this or follows this node in the tree), O(depth * fan-out)
+  size_t dfs_index(TreeNode const* node) const noexcept
+  {
+    _flush_batch();
+    auto const position = node->_dfs_position();
+    auto const position_this = _dfs_position();
+    assert(("The node precedes this node!", position >= position_this));
+    return position - position_this;
+  }
+
+  // The node n positions after (n < 0: before) this node in bfs order, nullptr past the last node.
+  // The steps are taken on the level of this node, whole levels are skipped by their widths and the target level is walked from its nearer end: O(height + min(|n|, width)).
+  // There are no order statistics inside a level, so a jump into the middle of a wide level is O(width / 2) node steps (plus the recount of its width after a removal or move).
+  TreeNode const* advance_bfs(ptrdiff_t n) const noexcept
+  {
+    auto const root = _root();
+    auto node = this;
+    auto depth = _depth;
+    auto const height = root->get_height();
+    if (n >= 0)
+    {
+      auto k = static_cast<size_t>(n);
+      for (auto const last = root->_level_end(depth, true); k > 0 && node != last; --k)
+        node = node->_next_bfs;
+
+      if (k == 0)
+        return node;
+
+      for (++depth, --k; depth < height && k >= root->size_level(depth); ++depth)
+        k -= root->size_level(depth);
+
+      assert(("Out of range!", depth < height || k == 0));
+      return depth < height ? root->_level_at(depth, k) : nullptr;
+    }
+
+    auto k = static_cast<size_t>(-n);
+    for (auto const first = root->_level_end(depth, false); k > 0 && node != first; --k)
+      node = node->_prev_bfs;
+
+    for (; k > 0; --depth)
+    {
+      if (depth == 0)
+      {
+        assert(("Out of range!", false));
+        return nullptr;
+      }
+
+      --k; // to the last node of the upper level
+      if (k < root->size_level(depth - 1))
+        return root->_level_at(depth - 1, root->size_level(depth - 1) - 1 - k);
+
+      k -= root->size_level(depth - 1) - 1;
+    }
+    return node;
+  }
+
+  TreeNode* advance_bfs(ptrdiff_t n) noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->advance_bfs(n)); // Scott Meyers
+  }
+
+  // The k-th node in bfs order (on the root: of the tree), nullptr past the last node. O(height + width) worst case (see advance_bfs()), nth_dfs() is O(depth * fan-out).
+  TreeNode const* nth_bfs(size_t k) const noexcept { return advance_bfs(static_cast<ptrdiff_t>(k)); }
+  TreeNode* nth_bfs(size_t k) noexcept { return advance_bfs(static_cast<ptrdiff_t>(k)); }
+
+  // Position of node in bfs order (node is this or follows this node in the tree), O(height + min(position, width - position) on the levels of the nodes), i.e. O(height + width) worst case
+  size_t bfs_index(TreeNode const* node) const noexcept
+  {
+    auto const position = node->_bfs_position();
+    auto const position_this = _bfs_position();
+    assert(("The node precedes this node!", position >= position_this));
+    return position - position_this;
+  }
+
+  // Level queries of the whole tree (the root is level 0), O(1) on the root. (After a subtree removal or move size_level() recounts the affected levels once, concurrent const calls may recount the same level.)
+  size_t get_height() const noexcept
+  {
+    auto const root = _root();
+    return root->_levels ? root->_levels->size() + 1 : 1;
+  }
+
+  size_t size_level(size_t depth) const noexcept
+  {
+    if (depth == 0)
+      return 1;
+
+    auto const root = _root();
+    if (!root->_levels || depth > root->_levels->size())
+      return 0;
+
+    auto& level = (*root->_levels)[depth - 1];
+    auto width = level.width.load(std::memory_order_relaxed);
+    if (width == _width_unknown)
+    {
+      width = 1;
+      for (auto p = level.first; p != level.last; p = p->_next_bfs)
+        ++width;
+
+      level.width.store(width, std::memory_order_relaxed);
+    }
+    return width;
+  }
+
+  TreeNode const* child_last_in_depth(size_t depth) const noexcept
+  {
+    auto const root = _root();
+    if (depth == 0)
+      return root;
+
+    return root->_levels && depth <= root->_levels->size() ? (*root->_levels)[depth - 1].last : nullptr;
+  }
+
+  TreeNode* child_last_in_depth(size_t depth) noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->child_last_in_depth(depth)); // Scott Meyers
+  }
+
+private:
+
+  TreeNode const* _root() const noexcept
+  {
+    auto root = this;
+    while (root->_parent)
+      root = root->_parent;
+
+    return root;
+  }
+
+  TreeNode* _root() noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->_root());
+  }
+
+  // Last node of the subtree in dfs order
+  TreeNode const* _dfs_last() const noexcept
+  {
+    auto node = this;
+    while (node->_child_last)
+      node = node->_child_last;
+
+    return node;
+  }
+
+  TreeNode* _dfs_last() noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->_dfs_last());
+  }
+
+  // The node after the subtree in dfs order (nullptr on the root's subtree), O(depth)
+  TreeNode const* _dfs_end() const noexcept
+  {
+    for (auto node = this; node; node = node->_parent)
+      if (node->_next)
+        return node->next();
+
+    return nullptr;
+  }
+
+  TreeNode* _dfs_end() noexcept
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->_dfs_end());
+  }
+
+  // Dfs threading: the subtree (its inner threads are intact) is spliced in after it is linked among its siblings
+  void _dfs_splice_in() noexcept
+  {
+    if (!IsDfsThreaded)
+      return;
+
+    auto const prev = _prev ? _prev->_dfs_last() : _parent;
+    auto const next = prev->_dfs_next();
+    _DfsThread::_dfs_link(_dfs_last(), next);
+    _DfsThread::_dfs_link(prev, this);
+  }
+
+  // Dfs threading: the subtree is spliced out (before it is unlinked from its siblings), its inner threads are kept
+  void _dfs_splice_out() noexcept
+  {
+    if (!IsDfsThreaded)
+      return;
+
+    auto const last = _dfs_last();
+    _DfsThread::_dfs_link(this->_dfs_prev(), last->_dfs_next());
+    _DfsThread::_dfs_link(nullptr, this);
+    _DfsThread::_dfs_link(last, nullptr);
+  }
+
+  // Dfs threading: the threads of the subtree are rebuilt from the sibling lists in one iterative pass
+  void _dfs_relink() noexcept
+  {
+    if (!IsDfsThreaded)
+      return;
+
+    auto const end = _dfs_end();
+    auto prev = this;
+    for (auto node = child_first(); node; )
+    {
+      _DfsThread::_dfs_link(prev, node);
+      prev = node;
+      if (node->_child_first)
+        node = node->child_first();
+      else
+      {
+        while (node != this && !node->_next)
+          node = node->_parent;
+
+        node = node != this ? node->next() : nullptr;
+      }
+    }
+    _DfsThread::_dfs_link(prev, end);
+  }
+
+  // The k-th node in the dfs order of the subtree (k < size()), the children are scanned from the nearer end
+  TreeNode const* _nth_in_subtree(size_t k) const noexcept
+  {
+    auto node = this;
+    while (k > 0)
+    {
+      auto const n = node->_size - 1;
+      --k;
+      if (k < n / 2)
+      {
+        auto child = node->child_first();
+        for (; k >= child->_size; child = child->next())
+          k -= child->_size;
+
+        node = child;
+      }
+      else
+      {
+        auto rest = n - k;
+        auto child = node->_child_last;
+        for (; rest > child->_size; child = child->_prev)
+          rest -= child->_size;
+
+        k = child->_size - rest;
+        node = child;
+      }
+    }
+    return node;
+  }
+
+  // Number of the nodes before the subtree among the descendants of the parent: the siblings are walked from both ends, the shorter side decides
+  size_t _size_before() const noexcept
+  {
+    size_t before = 0;
+    size_t after = 0;
+    for (auto prev = _prev, next = this->next(); ; prev = prev->_prev, next = next->next())
+    {
+      if (!prev)
+        return before;
+
+      if (!next)
+        return _parent->_size - 1 - _size - after;
+
+      before += prev->_size;
+      after += next->_size;
+    }
+  }
+
+  // Position in the dfs order of the tree
+  size_t _dfs_position() const noexcept
+  {
+    size_t position = 0;
+    for (auto node = this; node->_parent; node = node->_parent)
+      position += 1 + node->_size_before();
+
+    return position;
+  }
+
+  // Position in the bfs order of the tree: the widths of the upper levels and the position on the level (walked from both ends, the shorter side decides)
+  size_t _bfs_position() const noexcept
+  {
+    auto const root = _root();
+    size_t position = 0;
+    for (size_t depth = 0; depth < _depth; ++depth)
+      position += root->size_level(depth);
+
+    if (_depth == 0)
+      return position;
+
+    auto const first = root->_level_end(_depth, false);
+    auto const last = root->_level_end(_depth, true);
+    size_t steps = 0;
+    for (auto prev = this, next = this; ; prev = prev->_prev_bfs, next = next->_next_bfs, ++steps)
+    {
+      if (prev == first)
+        return position + steps;
+
+      if (next == last)
+        return position + root->size_level(_depth) - 1 - steps;
+    }
+  }
+
+  // First or last node of a level of the root
+  TreeNode const* _level_end(size_t depth, bool is_last) const noexcept
+  {
+    if (depth == 0)
+      return this;
+
+    auto const& level = (*_levels)[depth - 1];
+    return is_last ? level.last : level.first;
+  }
+
+  // The index-th node of a level of the root, walked from the nearer end
+  TreeNode const* _level_at(size_t depth, size_t index) const noexcept
+  {
+    auto const width = size_level(depth);
+    if (index < width / 2)
+    {
+      auto node = _level_end(depth, false);
+      for (; index > 0; --index)
+        node = node->_next_bfs;
+
+      return node;
+    }
+
+    auto node = _level_end(depth, true);
+    for (auto rest = width - 1 - index; rest > 0; --rest)
+      node = node->_prev_bfs;
+
+    return node;
+  }
+
+  // Only root can be moved, the children are adopted
+  void _move(TreeNode& r) noexcept
+  {
+    assert(("Only root can be moved!", !r._parent && !_parent));
+    _flush_batch();
+
+    data = std::move(r.data);
+    _child_first = std::move(r._child_first);
+    _child_last = r._child_last;
+    _next_bfs = r._next_bfs;
+    _size = r._size;
+    _reset_levels(_LevelsPtr(r._levels));
+    r._levels = nullptr;
+    _adopt_index(r);
+    _Aggregate::_aggregate_adopt(this, r);
+    _Ancestry::_ancestry_adopt(this, r);
+    _DfsThread::_dfs_link(this, r._dfs_next());
+    _DfsThread::_dfs_link(&r, nullptr);
+
+    for (auto child = child_first(); child; child = child->next())
+      child->_parent = this;
+
+    if (_next_bfs)
+      _next_bfs->_prev_bfs = this;
+
+    r._child_last = nullptr;
+    r._next_bfs = nullptr;
+    r._size = 1;
+  }
+
+  // Indexes of the children (TKeyOf and IsIndexedSiblings options), the child is already linked among its siblings
+  void _index_child(TreeNode* child)
+  {
+    this->_key_insert(child);
+    this->_rank_insert(child);
+  }
+
+  void _unindex_child(TreeNode* child) noexcept
+  {
+    this->_key_erase(child);
+    this->_rank_erase(child);
+  }
+
+  void _clear_index() noexcept
+  {
+    this->_key_clear();
+    this->_rank_clear();
+  }
+
+  // The children of r are adopted
+  void _adopt_index(TreeNode& r) noexcept
+  {
+    this->_key_adopt(r);
+    this->_rank_adopt(r);
+  }
+
+  _Levels& _get_levels(size_t depth)
+  {
+    if (!_levels)
+      _levels = _make_levels(0).release();
+
+    if (_levels->size() < depth)
+      _levels->resize(depth);
+
+    return *_levels;
+  }
+
+  // Level index registration of the [first, last] bfs range of n (or _width_unknown, but at most n_max) nodes, which is already linked into the bfs chain.
+  // Every node is visited once after it is labeled.
+  template<typename TVisitor>
+  static void _level_insert(TreeNode* first, TreeNode* last, size_t n, size_t n_max, _Level& level, TVisitor&& visit) noexcept
+  {
+    if (!level.first || level.first == last->_next_bfs)
+      level.first = first;
+
+    if (!level.last || level.last == first->_prev_bfs)
+      level.last = last;
+
+    auto const width = level.width.load(std::memory_order_relaxed);
+    if (width != _width_unknown)
+      level.width.store(n == _width_unknown ? _width_unknown : width + n, std::memory_order_relaxed);
+
+    _label_insert(first, last, n_max, level, visit);
+  }
+
+  static void _level_insert(TreeNode* first, TreeNode* last, size_t n, _Level& level) noexcept
+  {
+    _level_insert(first, last, n, n, level, [](TreeNode*) {});
+  }
+
+  static constexpr size_t _width_unknown = size_t(-1);
+
+  static constexpr uint64_t _label_universe = uint64_t(1) << 62;
+  static constexpr uint64_t _label_step = uint64_t(1) << 32;
+
+  // Order maintenance: the labels of the [first, last] range of at most n_max nodes are taken evenly from the gap of the neighbours, if it is exhausted, the labels are redistributed.
+  template<typename TVisitor>
+  static void _label_insert(TreeNode* first, TreeNode* last, size_t n_max, _Level const& level, TVisitor&& visit) noexcept
+  {
+    auto const prev = first == level.first ? nullptr : first->_prev_bfs;
+    auto const next = last == level.last ? nullptr : last->_next_bfs;
+    auto const lo = prev ? prev->_label + 1 : 0;
+    auto const hi = next ? next->_label : _label_universe;
+    auto const gap = lo < hi ? (hi - lo) / (n_max + 1) : 0;
+    if (gap > 0)
+    {
+      auto label = lo;
+      for (auto p = first; ; p = p->_next_bfs)
+      {
+        p->_label = label += gap < _label_step ? gap : _label_step;
+        visit(p);
+        if (p == last)
+          break;
+      }
+    }
+    else
+    {
+      // The range is collapsed onto the neighbour's label, the rebalance spreads it together with its surroundings.
+      auto const label = prev ? prev->_label : hi;
+      for (auto p = first; ; p = p->_next_bfs)
+      {
+        p->_label = label;
+        if (p == last)
+          break;
+      }
+
+      _label_rebalance(first, label, level);
+      for (auto p = first; ; p = p->_next_bfs)
+      {
+        visit(p);
+        if (p == last)
+          break;
+      }
+    }
+  }
+
+  // The smallest aligned label range around the node whose density is below (1.6/2)^i is relabeled evenly (amortized O(log n) labels per insertion).
+  static void _label_rebalance(TreeNode* node, uint64_t label, _Level const& level) noexcept
+  {
+    auto first = node;
+    auto last = node;
+    size_t n = 1;
+    uint64_t base = label;
+    uint64_t range = 1;
+    double capacity = 1.0;
+    for (int i = 1; i <= 62; ++i)
+    {
+      range <<= 1;
+      capacity *= 1.6;
+      base = label & ~(range - 1);
+      for (; first != level.first && first->_prev_bfs->_label >= base; first = first->_prev_bfs)
+        ++n;
+
+      for (; last != level.last && last->_next_bfs->_label - base < range; last = last->_next_bfs)
+        ++n;
+
+      if (static_cast<double>(n) < capacity)
+        break;
+    }
+
+    auto const gap = range / n;
+    for (auto p = first; n > 0; p = p->_next_bfs, --n)
+    {
+      p->_label = base;
+      base += gap;
+    }
+  }
+
+  // Level index unregistration of the [first, last] bfs range of n (or _width_unknown) nodes on depth, before it is unlinked from the bfs chain
+  static void _level_erase(_Levels& levels, TreeNode* first, TreeNode* last, size_t n, size_t depth) noexcept
+  {
+    auto& level = levels[depth - 1];
+    if (level.first == first && level.last == last)
+    {
+      level.first = level.last = nullptr;
+      level.width.store(0, std::memory_order_relaxed);
+    }
+    else
+    {
+      if (level.first == first)
+        level.first = last->_next_bfs;
+      else if (level.last == last)
+        level.last = first->_prev_bfs;
+
+      auto const width = level.width.load(std::memory_order_relaxed);
+      if (width != _width_unknown)
+        level.width.store(n == _width_unknown ? _width_unknown : width - n, std::memory_order_relaxed);
+    }
+  }
+
+  // The emptied deepest levels are dropped (after _level_erase-s)
+  static void _trim_levels(_Levels& levels) noexcept
+  {
+    while (!levels.empty() && !levels.back().first)
+      levels.pop_back();
+  }
+
+  void change_size(int const n) noexcept
+  {
+    for (auto p = this; p; p = p->_parent)
+      p->_size += n;
+  }
+
+  // The root of the tree, the marked nodes of a batch update store it (the mutations which could change it apply the batch first)
+  TreeNode* _batch_root() noexcept
+  {
+    auto const& batch = _batch();
+    if (batch.guard_num > 0 && !batch.pending.empty())
+    {
+      if (batch.pending.back().node == this)
+        return batch.pending.back().root;
+
+      auto const it = batch.indices.find(this);
+      if (it != batch.indices.end())
+        return batch.pending[it->second].root;
+    }
+
+    return _root();
+  }
+
+  // The ancestors grow by the [first, tail] run of n children: at once, or only this node is marked in a batch update (see batch_update)
+  void _grow(TreeNode const* first, TreeNode const* tail, size_t n, TreeNode* root)
+  {
+    auto& batch = _batch();
+    if (batch.guard_num == 0)
+    {
+      change_size(static_cast<int>(n));
+      _Aggregate::_aggregate_add(this, _Aggregate::_aggregate_run(first, tail));
+      return;
+    }
+
+    // Bursts usually grow the same node
+    if (batch.pending.empty() || batch.pending.back().node != this)
+    {
+      auto const it = batch.indices.find(this);
+      if (it == batch.indices.end())
+      {
+        // Strong guarantee: the new entry is dropped if it cannot be indexed
+        batch.pending.push_back({ this, root, n, _Aggregate::_aggregate_run(first, tail) });
+        try
+        {
+          batch.indices.emplace(this, batch.pending.size() - 1);
+        }
+        catch (...)
+        {
+          batch.pending.pop_back();
+          throw;
+        }
+        return;
+      }
+
+      std::swap(batch.pending[it->second], batch.pending.back());
+      batch.indices[batch.pending[it->second].node] = it->second;
+      it->second = batch.pending.size() - 1;
+    }
+
+    auto& pending = batch.pending.back();
+    pending.n += n;
+    _Aggregate::_aggregate_combine(pending.part, _Aggregate::_aggregate_run(first, tail));
+  }
+
+  // Linear deep copy of r's descendants into this childless root, level by level. The level nodes are processed by for_each(first, last, fn).
+  template<typename TForEach>
+  void _copy(TreeNode const& r, TForEach&& for_each)
+  {
+    std::vector<TreeNode const*> sources = { &r };
+    std::vector<TreeNode*> nodes = { this };
+    std::vector<size_t> child_begins = { 1 };
+
+    for (size_t begin = 0, end = 1; begin < end; begin = end, end = sources.size())
+    {
+      // The children of the level are collected first, so the new nodes have their place in advance
+      for (auto i = begin; i < end; ++i)
+      {
+        for (auto child = sources[i]->child_first(); child; child = child->next())
+          sources.push_back(child);
+
+        child_begins.push_back(sources.size());
+      }
+
+      nodes.resize(sources.size());
+      for_each(nodes.begin() + begin, nodes.begin() + end, [&](TreeNode*& node)
+      {
+        auto const i = &node - nodes.data();
+        TreeNode* prev = nullptr;
+        for (auto j = child_begins[i]; j < child_begins[i + 1]; ++j)
+        {
+          auto child_ptr = _make_node(sources[j]->data);
+          auto child = child_ptr.get();
+          child->_parent = node;
+          child->_prev = prev;
+          child->_depth = node->_depth + 1;
+          (prev ? prev->_next : node->_child_first) = std::move(child_ptr);
+
+          nodes[j] = child;
+          prev = child;
+        }
+        node->_child_last = prev;
+      });
+    }
+
+    _setup_bfs(nodes);
+  }
+
+  // Links the nodes under their parents in index order, then the root (the only one with out of range parent index) is moved into the returned object.
+  // The parent indices are validated before any linking, so the nodes are still owned by nodes (and freed) if it throws.
+  static TreeNode _build(std::vector<size_t> const& parents, std::vector<_NodePtr>& nodes)
+  {
+    auto const n = nodes.size();
+    if (n == 0)
+      throw std::invalid_argument("At least the root is required!");
+
+    size_t root_index = n;
+    for (size_t i = 0; i < n; ++i)
+      if (parents[i] >= n)
+      {
+        if (root_index < n)
+          throw std::invalid_argument("Only one root is allowed!");
+
+        root_index = i;
+      }
+
+    if (root_index == n)
+      throw std::invalid_argument("Root is missing!");
+
+    // Every parent chain must reach the root, every chain is walked once (1: on the current chain, 2: reaches the root)
+    std::vector<char> states(n);
+    std::vector<size_t> chain;
+    states[root_index] = 2;
+    for (size_t i = 0; i < n; ++i)
+    {
+      auto j = i;
+      for (; states[j] == 0; j = parents[j])
+      {
+        states[j] = 1;
+        chain.push_back(j);
+      }
+
+      if (states[j] == 1)
+        throw std::invalid_argument("Parent indices do not form a tree!"); // cycle (or self-parent)
+
+      for (auto const k : chain)
+        states[k] = 2;
+
+      chain.clear();
+    }
+
+    std::vector<TreeNode*> raw_nodes(n);
+    for (size_t i = 0; i < n; ++i)
+      raw_nodes[i] = nodes[i].get();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      auto const p = parents[i];
+      if (p >= n)
+        continue;
+
+      auto const parent = raw_nodes[p];
+      auto const child = raw_nodes[i];
+      child->_parent = parent;
+      child->_prev = parent->_child_last;
+      (parent->_child_last ? parent->_child_last->_next : parent->_child_first) = std::move(nodes[i]);
+      parent->_child_last = child;
+    }
+
+    auto const root_node = raw_nodes[root_index];
+    TreeNode root(std::move(root_node->data));
+    root._child_first = std::move(root_node->_child_first);
+    root._child_last = root_node->_child_last;
+    root_node->_child_last = nullptr;
+
+    std::vector<TreeNode*> nodes_bfs;
+    nodes_bfs.reserve(n);
+    nodes_bfs.push_back(&root);
+    for (size_t i = 0; i < nodes_bfs.size(); ++i)
+    {
+      auto const node = nodes_bfs[i];
+      for (auto child = node->child_first(); child; child = child->next())
+      {
+        child->_parent = node;
+        child->_depth = node->_depth + 1;
+        nodes_bfs.push_back(child);
+      }
+    }
+    assert(("Parent indices do not form a tree!", nodes_bfs.size() == n));
+
+    root._setup_bfs(nodes_bfs);
+    return root;
+  }
+
+  // Bfs chain, sizes and level index of a root whose nodes are given in bfs order (sibling links, parents and depths are already set)
+  void _setup_bfs(std::vector<TreeNode*> const& nodes)
+  {
+    auto const n = nodes.size();
+    for (size_t i = 0; i < n; ++i)
+    {
+      nodes[i]->_prev_bfs = i > 0 ? nodes[i - 1] : nullptr;
+      nodes[i]->_next_bfs = i + 1 < n ? nodes[i + 1] : nullptr;
+      nodes[i]->_size = 1;
+    }
+
+    for (auto i = n - 1; i > 0; --i)
+      nodes[i]->_parent->_size += nodes[i]->_size;
+
+    if (!std::is_void<TAggregate>::value)
+      for (auto i = n; i > 0; --i)
+        _Aggregate::_aggregate_recombine(nodes[i - 1]);
+
+    _reset_levels();
+    if (n > 1)
+      _get_levels(nodes.back()->_depth);
+
+    for (size_t i = 1; i < n; ++i)
+    {
+      auto const node = nodes[i];
+      auto& level = (*_levels)[node->_depth - 1];
+      if (!level.first)
+        level.first = node;
+
+      level.last = node;
+      auto const width = level.width.load(std::memory_order_relaxed) + 1;
+      level.width.store(width, std::memory_order_relaxed);
+      node->_label = width * _label_step;
+      if (node->_child_last)
+        level.parents.insert(level.parents.end(), node);
+
+      node->_parent->_index_child(node);
+    }
+
+    _dfs_relink();
+    _Ancestry::_ancestry_relabel(this);
+  }
+
+  // Inserts the [head, tail] sibling run of n nodes (linked by _prev/_next) after the prev child (nullptr: in front of the children): one bfs splice, one level update and one size update.
+  TreeNode* _setup_children(_NodePtr&& head, TreeNode* tail, size_t n, TreeNode* prev)
+  {
+    auto const depth = get_depth() + 1;
+    auto const root = _batch_root();
+    auto& levels = root->_get_levels(depth);
+    auto const first = head.get();
+
+    for (auto p = first; p; p = p->next())
+    {
+      p->_parent = this;
+      p->_depth = depth;
+      p->_prev_bfs = p->_prev;
+      p->_next_bfs = p->next();
+    }
+
+    // The run follows its previous sibling or precedes the next one. Else the children of the next parent on this level follow it, otherwise it closes its level.
+    auto prev_bfs_node = prev;
+    TreeNode* next_bfs_node = nullptr;
+    auto is_new_parent = false;
+    if (!prev && _child_first)
+      next_bfs_node = child_first();
+    else if (!prev)
+    {
+      prev_bfs_node = this;
+      if (depth > 1)
+      {
+        auto& parents = levels[depth - 2].parents;
+        auto const it = parents.upper_bound(this);
+        if (it != parents.end())
+          next_bfs_node = (*it)->child_first();
+        else
+          prev_bfs_node = levels[depth - 1].last ? levels[depth - 1].last : levels[depth - 2].last;
+
+        is_new_parent = true;
+      }
+    }
+
+    // The index entries are inserted before the linking (they may allocate), the tree is unchanged if it throws
+    size_t n_indexed = 0;
+    try
+    {
+      if (is_new_parent)
+        levels[depth - 2].parents.insert(this);
+
+      for (auto p = first; p; p = p->next(), ++n_indexed)
+        this->_key_insert(p);
+
+      _grow(first, tail, n, root); // the last fallible step, it may register a batch entry
+    }
+    catch (...)
+    {
+      for (auto p = first; n_indexed > 0; p = p->next(), --n_indexed)
+        this->_key_erase(p);
+
+      if (is_new_parent)
+        levels[depth - 2].parents.erase(this);
+
+      _trim_levels(levels);
+      throw;
+    }
+
+    auto& container = prev ? prev->_next : _child_first;
+    if (container)
+    {
+      container->_prev = tail;
+      tail->_next = std::move(container);
+    }
+    else
+      _child_last = tail;
+
+    first->_prev = prev;
+    container = std::move(head);
+
+    if (next_bfs_node)
+      prev_bfs_node = next_bfs_node->_prev_bfs;
+    else
+      next_bfs_node = prev_bfs_node->_next_bfs;
+
+    first->_prev_bfs = prev_bfs_node;
+    prev_bfs_node->_next_bfs = first;
+    tail->_next_bfs = next_bfs_node;
+    if (next_bfs_node)
+      next_bfs_node->_prev_bfs = tail;
+
+    _level_insert(first, tail, n, levels[depth - 1]);
+
+    for (auto p = first; p != tail->next(); p = p->next())
+    {
+      this->_rank_insert(p);
+      p->_dfs_splice_in();
+    }
+
+    _Ancestry::_ancestry_link(first, tail, 2 * n);
+
+    return first;
+  }
+
+  TreeNode* _setup_child(_NodePtr&& node, TreeNode* prev)
+  {
+    auto const child = node.get();
+    return _setup_children(std::move(node), child, 1, prev);
+  }
+
+  TreeNode* _setup_child(_NodePtr&& node)
+  {
+    return _setup_child(std::move(node), _child_last);
+  }
+
+  // The child before the index-th position (nullptr for the first position)
+  TreeNode* _child_before(size_t index) noexcept
+  {
+    TreeNode* prev = nullptr;
+    for (auto p = child_first(); index > 0; --index, p = p->next())
+    {
+      assert(("Index is out of range!", p));
+      prev = p;
+    }
+    return prev;
+  }
+
+  // Collects the nodes made by make_node(*it) into an unattached sibling run, then appends it at once
+  template<typename TInputIterator, typename TMakeNode>
+  TreeNode* _add_children(TInputIterator first, TInputIterator last, TMakeNode&& make_node)
+  {
+    _NodePtr head;
+    TreeNode* tail = nullptr;
+    size_t n = 0;
+    for (; first != last; ++first, ++n)
+    {
+      auto node = make_node(*first);
+      node->_prev = tail;
+      auto const p = node.get();
+      (tail ? tail->_next : head) = std::move(node);
+      tail = p;
+    }
+
+    if (n == 0)
+      return nullptr;
+
+    return _setup_children(std::move(head), tail, n, _child_last);
+  }
+
+public:
+  TreeNode* add_child(T const& d)
+  {
+    return _setup_child(_make_node(d));
+  }
+  
+  TreeNode* add_child(T&& d)
+  {
+    return _setup_child(_make_node(std::move(d)));
+  }
+
+  // Appends a child whose data is constructed in place from args
+  template<typename... Args>
+  TreeNode* emplace_child(Args&&... args)
+  {
+    return _setup_child(_make_node(_EmplaceTag{}, std::forward<Args>(args)...));
+  }
+
+  // Inserts a child in front of the children
+  TreeNode* push_front_child(T const& d) { return _setup_child(_make_node(d), nullptr); }
+  TreeNode* push_front_child(T&& d) { return _setup_child(_make_node(std::move(d)), nullptr); }
+
+  // Inserts a child to the index-th position of the children (index <= number of children, O(index))
+  TreeNode* insert_child_at(size_t index, T const& d) { return _setup_child(_make_node(d), _child_before(index)); }
+  TreeNode* insert_child_at(size_t index, T&& d) { return _setup_child(_make_node(std::move(d)), _child_before(index)); }
+
+  // Inserts a child before the position of a segment iterator of this node (end_segment(): appended)
+  template<typename T_or_NodePtr>
+  TreeNode* insert_child_at(IteratorSegment<T, T_or_NodePtr, TreeNode> const& it, T const& d) { return _setup_child(_make_node(d), it.node() ? it.node()->_prev : _child_last); }
+
+  template<typename T_or_NodePtr>
+  TreeNode* insert_child_at(IteratorSegment<T, T_or_NodePtr, TreeNode> const& it, T&& d) { return _setup_child(_make_node(std::move(d)), it.node() ? it.node()->_prev : _child_last); }
+
+  // Inserts a sibling before/after this node
+  TreeNode* insert_before(T const& d) { return _insert_sibling(_make_node(d), _prev); }
+  TreeNode* insert_before(T&& d) { return _insert_sibling(_make_node(std::move(d)), _prev); }
+  TreeNode* insert_after(T const& d) { return _insert_sibling(_make_node(d), this); }
+  TreeNode* insert_after(T&& d) { return _insert_sibling(_make_node(std::move(d)), this); }
+
+private:
+  TreeNode* _insert_sibling(_NodePtr&& node, TreeNode* prev)
+  {
+    assert(("Root cannot have siblings!", _parent));
+    return _parent->_setup_child(std::move(node), prev);
+  }
+
+public:
+
+  // Appends a node for every value of [first, last) as children, the tree is updated once for the whole run. Returns the first new child (nullptr if the range is empty).
+  template<typename TInputIterator>
+  TreeNode* add_children(TInputIterator first, TInputIterator last)
+  {
+    return _add_children(first, last, [](auto&& value) { return _make_node(std::forward<decltype(value)>(value)); });
+  }
+
+  // As add_children, but the data of the children are constructed in place from the elements of [first, last)
+  template<typename TInputIterator>
+  TreeNode* emplace_children(TInputIterator first, TInputIterator last)
+  {
+    return _add_children(first, last, [](auto&& value) { return _make_node(_EmplaceTag{}, std::forward<decltype(value)>(value)); });
+  }
+
+
+  // Child by key in O(1) on average, nullptr if there is none (TKeyOf policy is required). If more children have the same key, one of them is returned.
+  // The key of an indexed child must not be changed through get().
+  TreeNode const* find_child(key_type const& key) const
+  {
+    static_assert(!std::is_void<TKeyOf>::value, "find_child() requires the TKeyOf policy!");
+    return this->_key_find(key);
+  }
+
+  TreeNode* find_child(key_type const& key)
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->find_child(key)); // Scott Meyers
+  }
+
+  // Descends along the keys of [first, last) by find_child(), nullptr if a key is not found (an empty path resolves to this node)
+  template<typename TInputIterator>
+  TreeNode const* resolve(TInputIterator first, TInputIterator last) const
+  {
+    auto node = this;
+    for (; node && first != last; ++first)
+      node = node->find_child(*first);
+
+    return node;
+  }
+
+  template<typename TInputIterator>
+  TreeNode* resolve(TInputIterator first, TInputIterator last)
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->resolve(first, last)); // Scott Meyers
+  }
+
+  // Resolves a range of keys, e.g.: root.resolve(std::vector<std::string>{ "a", "b", "c" })
+  template<typename TPath>
+  TreeNode const* resolve(TPath const& path) const { return resolve(std::begin(path), std::end(path)); }
+
+  template<typename TPath>
+  TreeNode* resolve(TPath const& path) { return resolve(std::begin(path), std::end(path)); }
+
+
+  // Swaps the data of the nodes (the children index of the parents is kept up to date)
+  static inline void swap(TreeNode* node1, TreeNode* node2)
+  {
+    if (node1 == node2)
+      return;
+
+    _flush_batch();
+    for (auto node : { node1, node2 })
+      if (node->_parent)
+        node->_parent->_key_erase(node);
+
+    auto const own1 = _Aggregate::_aggregate_own(node1);
+    auto const own2 = _Aggregate::_aggregate_own(node2);
+    std::swap(node1->get(), node2->get());
+    _Aggregate::_aggregate_changed(node1, own1);
+    _Aggregate::_aggregate_changed(node2, own2);
+
+    for (auto node : { node1, node2 })
+      if (node->_parent)
+        node->_parent->_key_insert(node);
+  }
+
+  inline void swap(TreeNode* node2) { swap(this, node2); }
+
+  void clear() noexcept
+  {
+    if (!_child_last)
+      return;
+
+    _flush_batch();
+    if (IsDfsThreaded)
+      _DfsThread::_dfs_link(this, _dfs_last()->_dfs_next());
+
+    if (_parent)
+      _unlink_descendants(*_root()->_levels);
+    else
+    {
+      // Every other node is a descendant of the root
+      _reset_levels();
+      _next_bfs = nullptr;
+    }
+
+    auto const n = _size - 1;
+    _child_last = nullptr;
+    _clear_index();
+    change_size(-static_cast<int>(n));
+    _Aggregate::_aggregate_clear(this);
+
+    _release(std::move(_child_first), n);
+  }
+
+  void remove() noexcept
+  {
+    if (!_parent)
+    {
+      assert(("Root cannot be removed!", false));
+      return;
+    }
+
+    _flush_batch();
+    _dfs_splice_out();
+
+    auto& levels = *_root()->_levels;
+    if (_child_last)
+      _unlink_descendants(levels);
+
+    auto const depth = get_depth();
+    if (depth > 1 && _parent->child_first() == _parent->_child_last)
+      levels[depth - 2].parents.erase(_parent);
+
+    _level_erase(levels, this, this, 1, depth);
+    _trim_levels(levels);
+
+    // Bfs rewire
+    if (_next_bfs)
+      _next_bfs->_prev_bfs = _prev_bfs;
+
+    if (_prev_bfs)
+      _prev_bfs->_next_bfs = _next_bfs;
+
+    _release(_unlink_sibling(), _size);
+  }
+
+  // Relinks the subtree as the last child of new_parent (of this or of another tree), the nodes are not copied.
+  // O(height * log width) bfs and level index work, the depths and the order labels of the moved nodes are rewritten.
+  void move_to(TreeNode* new_parent)
+  {
+    if (new_parent->_child_last != this)
+      _move_subtree(new_parent, new_parent->_child_last);
+  }
 
-template<typename T> 
-class TreeNode;
+  // Relinks the subtree as the previous sibling of sibling (see move_to)
+  void move_before(TreeNode* sibling)
+  {
+    assert(("Root cannot have siblings!", sibling->_parent));
+    if (sibling != this && sibling->_prev != this)
+      _move_subtree(sibling->_parent, sibling->_prev);
+  }
 
-template<typename T, typename TValueType, typename TRefAndPointerBase, typename TNode, typename StepManager>
-class IteratorNodeTreeBase;
+  // Relinks the subtree as the next sibling of sibling (see move_to)
+  void move_after(TreeNode* sibling)
+  {
+    assert(("Root cannot have siblings!", sibling->_parent));
+    if (sibling != this)
+      _move_subtree(sibling->_parent, sibling);
+  }
 
+  // Cuts the subtree out into a standalone tree, the nodes are relinked, not copied. The data of this node is moved into the returned root, this node is destroyed.
+  // O(height * log width) bfs and level index work, the parent entries of the level index are transferred and the depths of the subtree are rewritten.
+  TreeNode detach()
+  {
+    assert(("Root cannot be detached!", _parent));
+    _flush_batch();
 
-struct StepManagerSegment;
+    auto& levels_source = *_root()->_levels;
+    auto const ranges = _subtree_ranges(levels_source);
+    auto levels = _make_levels(ranges.size() - 1);
+
+    // The parent entries of the descendant levels are copied first, the source tree is unchanged if it throws
+    auto const depth = _depth;
+    for (size_t k = 1; k < ranges.size(); ++k)
+    {
+      auto const& parents = levels_source[depth + k - 1].parents;
+      auto& parents_detached = (*levels)[k - 1].parents;
+      for (auto it = parents.lower_bound(ranges[k].first), it_last = parents.upper_bound(ranges[k].last); it != it_last; ++it)
+        parents_detached.insert(parents_detached.end(), *it);
+    }
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorSegment = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TreeNode<T>, StepManagerSegment>;
+    _dfs_splice_out();
+    if (depth > 1 && _parent->child_first() == _parent->_child_last)
+      levels_source[depth - 2].parents.erase(_parent);
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorSegmentConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TreeNode<T> const, StepManagerSegment>;
+    for (size_t k = 0; k < ranges.size(); ++k)
+    {
+      auto const& range = ranges[k];
+      auto& parents = levels_source[depth + k - 1].parents;
+      parents.erase(parents.lower_bound(range.first), parents.upper_bound(range.last));
 
+      _level_erase(levels_source, range.first, range.last, _width_unknown, depth + k);
 
-struct StepManagerDfs;
+      range.first->_prev_bfs->_next_bfs = range.last->_next_bfs;
+      if (range.last->_next_bfs)
+        range.last->_next_bfs->_prev_bfs = range.first->_prev_bfs;
+    }
+    _trim_levels(levels_source);
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorDfs = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TreeNode<T>, StepManagerDfs>;
+    // The level ranges are chained into the bfs chain of the new root
+    for (size_t k = 0; k < ranges.size(); ++k)
+    {
+      auto const& range = ranges[k];
+      range.first->_prev_bfs = k > 0 ? ranges[k - 1].last : nullptr;
+      range.last->_next_bfs = k + 1 < ranges.size() ? ranges[k + 1].first : nullptr;
+      if (k > 0)
+      {
+        auto& level = (*levels)[k - 1];
+        level.first = range.first;
+        level.last = range.last;
+        level.width.store(_width_unknown, std::memory_order_relaxed);
+      }
+    }
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorDfsConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TreeNode<T> const, StepManagerDfs>;
+    for (auto p = _next_bfs; p; p = p->_next_bfs)
+      p->_depth -= depth;
 
+    auto node = _unlink_sibling();
 
+    TreeNode root(std::move(data));
+    root._child_first = std::move(_child_first);
+    root._child_last = _child_last;
+    root._next_bfs = _next_bfs;
+    root._size = _size;
+    root._adopt_index(*this);
+    _Aggregate::_aggregate_adopt(&root, *this);
+    if (ranges.size() > 1)
+      root._reset_levels(std::move(levels));
 
-struct StepManagerBfs;
+    _child_last = nullptr;
+    _next_bfs = nullptr;
+    for (auto child = root.child_first(); child; child = child->next())
+      child->_parent = &root;
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorBfs = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr, TreeNode<T>, StepManagerBfs>;
+    if (root._next_bfs)
+      root._next_bfs->_prev_bfs = &root;
 
-template<typename T, typename T_or_NodePtr = T>
-using IteratorBfsConst = IteratorNodeTreeBase<T, T_or_NodePtr, T_or_NodePtr const, TreeNode<T> const, StepManagerBfs>;
+    _Ancestry::_ancestry_relabel(&root);
+    _DfsThread::_dfs_link(&root, this->_dfs_next());
+    return root;
+  }
 
+  // Attaches the whole tree of other as the last child, its nodes are relinked, not copied (only its root's data is moved into a new node). Returns the new child.
+  // O(height * log width) bfs and level index work, the grafted nodes are visited once (depth and order label).
+  TreeNode* graft(TreeNode&& other)
+  {
+    assert(("Only a root can be grafted!", !other._parent));
+    assert(("A tree cannot be grafted into itself!", _root() != &other));
+    _flush_batch();
+
+    auto node_ptr = _make_node(std::move(other.data));
+    auto const node = node_ptr.get();
+
+    // The allocations and the key index entry of the new child come first (the key may throw), this tree and other are unchanged if they throw
+    std::vector<_LevelRange> ranges;
+    _Levels* levels = nullptr;
+    auto const is_new_parent = _depth > 0 && !_child_last;
+    _ParentNodes parent_nodes;
+    try
+    {
+      size_t n_parents = 0;
+      ranges.push_back({ node, node });
+      if (other._levels)
+        for (auto const& level : *other._levels)
+        {
+          ranges.push_back({ level.first, level.last });
+          n_parents += level.parents.size();
+        }
 
+      levels = &_root()->_get_levels(_depth + ranges.size());
+      parent_nodes.reserve(n_parents, other._child_last ? 1 : 0);
+      if (is_new_parent)
+        (*levels)[_depth - 1].parents.insert(this);
+
+      this->_key_insert(node); // the last fallible step
+    }
+    catch (...)
+    {
+      if (levels)
+      {
+        if (is_new_parent)
+          (*levels)[_depth - 1].parents.erase(this);
+
+        _trim_levels(*levels);
+      }
+
+      other.data = std::move(node->data);
+      throw;
+    }
+
+    node->_child_first = std::move(other._child_first);
+    node->_child_last = other._child_last;
+    node->_size = other._size;
+    node->_adopt_index(other);
+    _Aggregate::_aggregate_adopt(node, other);
+    _DfsThread::_dfs_link(node, other._dfs_next());
+    _DfsThread::_dfs_link(&other, nullptr);
+    for (auto child = node->child_first(); child; child = child->next())
+      child->_parent = node;
+
+    if (other._levels)
+      for (auto& level : *other._levels)
+        parent_nodes.erase(level.parents, level.parents.begin(), level.parents.end());
+
+    other._child_last = nullptr;
+    other._next_bfs = nullptr;
+    other._size = 1;
+    other._reset_levels();
+
+    node->_parent = this;
+    node->_prev = _child_last;
+    (_child_last ? _child_last->_next : _child_first) = std::move(node_ptr);
+    _child_last = node;
+    this->_rank_insert(node);
+    node->_dfs_splice_in();
+
+    node->_link_subtree(*levels, ranges, parent_nodes);
+    _Ancestry::_ancestry_link(node, node, 2 * node->_size);
+    change_size(static_cast<int>(node->_size));
+    _Aggregate::_aggregate_add(this, _Aggregate::_aggregate_get(node));
+
+    return node;
+  }
+
+  // Sorts the children by comp on their data (stable). The nodes are relinked, not swapped: the subtrees travel with their roots.
+  // The bfs chain of the subtree is rebuilt with the former order labels, O(size) besides the sort.
+  template<typename Compare = std::less<T>>
+  void sort_children(Compare comp = Compare{})
+  {
+    if (!_child_first || _child_first.get() == _child_last)
+      return;
+
+    auto const ranges = _descendant_ranges();
+    _sort_segment(comp);
+    _relink_descendants(ranges);
+  }
+
+  // Sorts every sibling list of the subtree by comp on their data (see sort_children)
+  template<typename Compare = std::less<T>>
+  void sort_all_segments(Compare comp = Compare{})
+  {
+    _sort_all_segments(comp, [](auto first, auto last, auto fn) { std::for_each(first, last, fn); });
+  }
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  // Sorts every sibling list of the subtree, the segments are sorted in parallel by the execution policy (comp is called concurrently)
+  template<typename ExecutionPolicy, typename Compare = std::less<T>, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+  void sort_all_segments(ExecutionPolicy&& policy, Compare comp = Compare{})
+  {
+    _sort_all_segments(comp, [&policy](auto first, auto last, auto fn) { std::for_each(policy, first, last, fn); });
+  }
+#endif
+
+  // Decision of the pre-visit of visit_dfs()
+  enum class DfsVisit
+  {
+    go_on,        // the children are visited
+    skip_subtree, // the descendants are not visited
+    stop          // the visit ends, no further pre- or post-visit
+  };
 
-template<typename T>
-class TreeNode
-{
 private:
-  T data{};
+  struct _NoPostVisit
+  {
+    void operator()(TreeNode const&) const noexcept {}
+  };
 
-  TreeNode* _parent = nullptr;
+public:
+  // Pruning depth first visit of the subtree: pre_visit(node) returns a DfsVisit, post_visit(node) is called after the subtree of the node (also when it was skipped).
+  // The descendants deeper than max_depth (relative to this node) are skipped. Only the visited nodes are touched. Returns false if the visit was stopped.
+  template<typename TPreVisit, typename TPostVisit = _NoPostVisit>
+  bool visit_dfs(TPreVisit&& pre_visit, TPostVisit&& post_visit = TPostVisit{}, size_t max_depth = -1)
+  {
+    return _visit_dfs(this, pre_visit, post_visit, max_depth);
+  }
 
-  TreeNode* _prev = nullptr;
-  std::unique_ptr<TreeNode> _next{};
+  template<typename TPreVisit, typename TPostVisit = _NoPostVisit>
+  bool visit_dfs(TPreVisit&& pre_visit, TPostVisit&& post_visit = TPostVisit{}, size_t max_depth = -1) const
+  {
+    return _visit_dfs(this, pre_visit, post_visit, max_depth);
+  }
 
-  std::unique_ptr<TreeNode> _child_first{};
-  TreeNode* _child_last = nullptr;
+private:
+  // The walk climbs the parents after a subtree, so every post-visit is in place
+  template<typename TNode, typename TPreVisit, typename TPostVisit>
+  static bool _visit_dfs(TNode* top, TPreVisit& pre_visit, TPostVisit& post_visit, size_t max_depth)
+  {
+    auto node = top;
+    size_t depth = 0;
+    for (;;)
+    {
+      auto const visit = pre_visit(*node);
+      if (visit == DfsVisit::stop)
+        return false;
 
-  TreeNode* _prev_bfs = nullptr;
-  TreeNode* _next_bfs = nullptr;
+      if (visit == DfsVisit::go_on && depth < max_depth && node->_child_first)
+      {
+        node = node->child_first();
+        ++depth;
+        continue;
+      }
 
-  size_t _size = 1;
+      post_visit(*node);
+      while (node != top && !node->_next)
+      {
+        node = node->parent();
+        --depth;
+        post_visit(*node);
+      }
+
+      if (node == top)
+        return true;
+
+      node = node->next();
+    }
+  }
 
 public:
-  TreeNode() = default;
-  TreeNode(const TreeNode<T>& r) { *this = r._copy(); }
-  TreeNode(TreeNode<T>&&) = default;
-  TreeNode<T>& operator=(TreeNode<T> const& r) { return TreeNode<T>(r); }
-  TreeNode<T>& operator=(TreeNode<T>&&) = default;
-  TreeNode(std::initializer_list<T> values)
+  // Reclamation of the subtrees of remove() and clear()
+  enum class Reclamation
   {
-    auto it = values.begin();
-    if (it != values.end())
-      data = *it;
+    immediate, // the subtree is destroyed by the call
+    deferred   // the subtree is only unlinked, it is destroyed by reclaim()
+  };
+
+  // The mode is shared by every tree of the same TreeNode type
+  static void set_reclamation(Reclamation reclamation) noexcept { _reclaimer().mode.store(reclamation, std::memory_order_relaxed); }
+  static Reclamation get_reclamation() noexcept { return _reclaimer().mode.load(std::memory_order_relaxed); }
+
+  // Destroys the deferred subtrees and returns the number of destroyed nodes. Thread safe, so it can be called by a background thread as well.
+  // (The destructor of T runs on the calling thread. The queued nodes are in use, TreeNodePoolAllocator::release() fails until they are reclaimed.)
+  static size_t reclaim() noexcept
+  {
+    auto& reclaimer = _reclaimer();
+    std::vector<_NodePtr> subtrees;
+    size_t n = 0;
+    {
+      std::lock_guard<std::mutex> lock(reclaimer.mutex);
+      subtrees.swap(reclaimer.subtrees);
+      std::swap(n, reclaimer.node_num);
+    }
+
+    for (auto& subtree : subtrees)
+      _destroy(std::move(subtree));
 
-    for (++it; it != values.end(); ++it)
-      add_child(*it);
+    return n;
   }
 
-  explicit TreeNode(T const& d) : data(d) {}
-  explicit TreeNode(T && d) : data(std::forward<T>(d)) {}
+  // Number of the nodes which are waiting for reclaim()
+  static size_t size_deferred() noexcept
+  {
+    auto& reclaimer = _reclaimer();
+    std::lock_guard<std::mutex> lock(reclaimer.mutex);
+    return reclaimer.node_num;
+  }
 
-  // Get data
-  T const& get() const noexcept { return data; }
-  T& get() noexcept { return data; }
+  // Deferred size and aggregate updates for insertion bursts: while a guard lives, an insertion only marks its parent (on the thread of the guard, in every tree of the same TreeNode type).
+  // The sizes and the aggregates of the marked nodes and their ancestors are updated at once, every ancestor is written once: by the next size(), aggregate(), dfs order statistics, removal, move, or when the last guard ends.
+  class batch_update
+  {
+  public:
+    batch_update() noexcept { ++_batch().guard_num; }
+    ~batch_update()
+    {
+      if (--_batch().guard_num == 0)
+        _flush_batch();
+    }
 
-  // Segment navigation
-  inline TreeNode* prev() noexcept { return _prev; }
-  inline TreeNode const* prev() const noexcept { return _prev; }
+    batch_update(batch_update const&) = delete;
+    batch_update& operator=(batch_update const&) = delete;
+  };
 
-  inline TreeNode* next() noexcept { return _next.get(); }
-  inline TreeNode const* next() const noexcept { return _next.get(); }
+private:
+  // The descendants are unlinked from the bfs chain and from the level index level by level: the descendants on a level form a contiguous bfs range,
+  // the range of the next level is bounded by the children of its first and last parent. The ranges are not walked (the widths are recounted lazily), so it is O(height * log width) besides the erased parent entries.
+  void _unlink_descendants(_Levels& levels) noexcept
+  {
+    levels[_depth - 1].parents.erase(this);
 
-  // Subsegment navigation
-  inline TreeNode* parent() { return _parent; }
-  inline TreeNode const* parent() const { return _parent; }
+    auto first = child_first();
+    auto last = _child_last;
+    for (auto depth = _depth + 1; first; ++depth)
+    {
+      TreeNode* first_next = nullptr;
+      TreeNode* last_next = nullptr;
+      auto& parents = levels[depth - 1].parents;
+      auto const it_first = parents.lower_bound(first);
+      auto const it_last = parents.upper_bound(last);
+      if (it_first != it_last)
+      {
+        first_next = (*it_first)->child_first();
+        last_next = (*std::prev(it_last))->_child_last;
+        parents.erase(it_first, it_last);
+      }
 
-  inline TreeNode* child_first() noexcept { return _child_first.get(); }
-  inline TreeNode const* child_first() const noexcept { return _child_first.get(); }
+      _level_erase(levels, first, last, _width_unknown, depth);
 
-  inline TreeNode* child_last() noexcept { return _child_last; }
-  inline TreeNode const* child_last() const noexcept { return _child_last; }
+      first->_prev_bfs->_next_bfs = last->_next_bfs;
+      if (last->_next_bfs)
+        last->_next_bfs->_prev_bfs = first->_prev_bfs;
 
-  // Breadth first search
-  inline TreeNode * prev_bfs() noexcept { return _prev_bfs; }
-  inline TreeNode const* prev_bfs() const noexcept { return _prev_bfs; }
+      first = first_next;
+      last = last_next;
+    }
 
-  inline TreeNode * next_bfs() noexcept { return _next_bfs; }
-  inline TreeNode const* next_bfs() const noexcept { return _next_bfs; }
+    _trim_levels(levels);
+  }
+
+  // Detaches the node from the siblings and from the ancestors' size, the node is returned
+  _NodePtr _unlink_sibling() noexcept
+  {
+    auto const parent = _parent;
+    _parent->_unindex_child(this);
+    _parent->change_size(-static_cast<int>(_size));
+    if (_parent->_child_last == this)
+      _parent->_child_last = _prev;
+
+    auto& container = _prev ? _prev->_next : _parent->_child_first;
+    auto node = std::move(container);
+    if (_next)
+    {
+      _next->_prev = _prev;
+      container = std::move(_next);
+    }
+
+    _parent = nullptr;
+    _prev = nullptr;
+    _levels = nullptr; // a root without level index in place of the label
+    _Aggregate::_aggregate_remove(parent, this);
+    return node;
+  }
+
+  // Bfs range of a level of a subtree
+  struct _LevelRange
+  {
+    TreeNode* first;
+    TreeNode* last;
+  };
+
+  // The set nodes of the parent entries of a moved or grafted subtree: the erased entries are kept and reused by the registration on the new levels, which does not allocate then.
+  // The room and the missing nodes are allocated before the subtree is unlinked. Before C++17 (no node handles) the entries are erased and allocated again.
+  class _ParentNodes
+  {
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+    std::vector<typename _Parents::node_type, _Allocator<typename _Parents::node_type>> _nodes;
+
+  public:
+    // Room for n_erased erased entries, and n_new nodes are allocated
+    void reserve(size_t n_erased, size_t n_new)
+    {
+      _nodes.reserve(n_erased + n_new);
+      for (_Parents spare; n_new > 0; --n_new)
+      {
+        spare.insert(nullptr);
+        _nodes.push_back(spare.extract(spare.begin()));
+      }
+    }
+
+    void erase(_Parents& parents, typename _Parents::const_iterator first, typename _Parents::const_iterator last) noexcept
+    {
+      while (first != last)
+        _nodes.push_back(parents.extract(first++));
+    }
 
-  size_t get_depth() const noexcept
+    void insert(_Parents& parents, typename _Parents::const_iterator hint, TreeNode* parent) noexcept
+    {
+      assert(("The set nodes are reserved!", !_nodes.empty()));
+      auto node = std::move(_nodes.back());
+      _nodes.pop_back();
+      node.value() = parent;
+      parents.insert(hint, std::move(node));
+    }
+#else
+  public:
+    void reserve(size_t, size_t) noexcept {}
+
+    void erase(_Parents& parents, typename _Parents::const_iterator first, typename _Parents::const_iterator last) noexcept { parents.erase(first, last); }
+
+    void insert(_Parents& parents, typename _Parents::const_iterator hint, TreeNode* parent) noexcept { parents.insert(hint, parent); }
+#endif
+  };
+
+  // The bfs ranges of the subtree's levels, from the node's own level (the ranges are bounded by the parents, they are not walked)
+  std::vector<_LevelRange> _subtree_ranges(_Levels const& levels)
   {
-    size_t d = 0;
-    for (auto p = _parent; p; p = p->_parent)
-      ++d;
+    std::vector<_LevelRange> ranges;
+    auto first = this;
+    auto last = this;
+    for (auto depth = _depth; ; ++depth)
+    {
+      ranges.push_back({ first, last });
 
-    return d;
+      auto const& parents = levels[depth - 1].parents;
+      auto const it_first = parents.lower_bound(first);
+      auto const it_last = parents.upper_bound(last);
+      if (it_first == it_last)
+        return ranges;
+
+      first = (*it_first)->child_first();
+      last = (*std::prev(it_last))->_child_last;
+    }
   }
 
-  size_t size() const noexcept { return _size; }
-  size_t size_segment() const noexcept
+  // The bfs range of the next level of the subtree of top after its [first, last] range (nullptrs after the last level): the children of the first and the last parent in the range, O(log width)
+  template<typename TNodePtr>
+  static void _subtree_level_next(TreeNode const* root, TreeNode const* top, TNodePtr& first, TNodePtr& last) noexcept
   {
-    size_t n = 0;
-    for (auto p = child_first(); p; p = p->next())
-      ++n;
+    if (first == top)
+    {
+      first = top->_child_first.get();
+      last = top->_child_last;
+      return;
+    }
+
+    auto const& parents = (*root->_levels)[first->_depth - 1].parents;
+    auto const it_first = parents.lower_bound(const_cast<TreeNode*>(static_cast<TreeNode const*>(first)));
+    auto const it_last = parents.upper_bound(const_cast<TreeNode*>(static_cast<TreeNode const*>(last)));
+    if (it_first == it_last)
+    {
+      first = nullptr;
+      last = nullptr;
+      return;
+    }
+
+    first = (*it_first)->child_first();
+    last = (*std::prev(it_last))->_child_last;
+  }
 
+  // The number of the parent entries of the subtree's levels
+  static size_t _parent_count(_Levels const& levels, std::vector<_LevelRange> const& ranges) noexcept
+  {
+    size_t n = 0;
+    auto depth = ranges.front().first->_depth;
+    for (auto const& range : ranges)
+    {
+      auto const& parents = levels[depth++ - 1].parents;
+      n += std::distance(parents.lower_bound(range.first), parents.upper_bound(range.last));
+    }
     return n;
   }
-private:
 
-  void change_size(int const n) noexcept
+  // Unlinks the subtree from the bfs chain and from the level index, the sibling links are kept. The parent entries of the subtree are kept by parent_nodes.
+  void _unlink_subtree(_Levels& levels, std::vector<_LevelRange> const& ranges, _ParentNodes& parent_nodes) noexcept
   {
-    for (auto p = this; p; p = p->_parent)
-      p->_size += n;
+    auto depth = _depth;
+    if (depth > 1 && _parent->child_first() == _parent->_child_last)
+      levels[depth - 2].parents.erase(_parent);
+
+    for (auto const& range : ranges)
+    {
+      auto& parents = levels[depth - 1].parents;
+      parent_nodes.erase(parents, parents.lower_bound(range.first), parents.upper_bound(range.last));
+      _level_erase(levels, range.first, range.last, _width_unknown, depth);
+
+      range.first->_prev_bfs->_next_bfs = range.last->_next_bfs;
+      if (range.last->_next_bfs)
+        range.last->_next_bfs->_prev_bfs = range.first->_prev_bfs;
+
+      ++depth;
+    }
   }
 
-  void _copy_segment(TreeNode<T> * root) const noexcept
+  // Links the subtree of the node, which is already placed among its new siblings, into the bfs chain and the level index level by level.
+  // A level range follows the previous sibling or precedes the next one, deeper ranges precede the children of the next parent on the upper level, otherwise they close their level.
+  // The nodes are visited once: they are relabeled, their depth is shifted and the parents are registered by parent_nodes. The widths of the levels are recounted lazily.
+  // The entry of a new parent is inserted by the caller before the linking.
+  void _link_subtree(_Levels& levels, std::vector<_LevelRange> const& ranges, _ParentNodes& parent_nodes) noexcept
   {
-    for (auto p = child_first(); p; p = p->next())
+    auto const depth = _parent->_depth + 1;
+    auto const depth_shift = depth - _depth;
+    TreeNode* next_parent = nullptr;
+    for (size_t k = 0; k < ranges.size(); ++k)
     {
-      auto child = root->add_child(p->get());
-      p->_copy_segment(child);
+      auto const& range = ranges[k];
+      auto const d = depth + k;
+      auto& level = levels[d - 1];
+
+      TreeNode* prev_bfs_node = nullptr;
+      TreeNode* next_bfs_node = nullptr;
+      if (k > 0)
+        next_bfs_node = next_parent ? next_parent->child_first() : nullptr;
+      else if (_prev)
+        prev_bfs_node = _prev;
+      else if (_next)
+        next_bfs_node = next();
+      else if (d > 1)
+      {
+        auto const& parents = levels[d - 2].parents;
+        auto const it = parents.upper_bound(_parent);
+        if (it != parents.end())
+          next_bfs_node = (*it)->child_first();
+      }
+
+      if (next_bfs_node)
+        prev_bfs_node = next_bfs_node->_prev_bfs;
+      else
+      {
+        if (!prev_bfs_node)
+          prev_bfs_node = level.last ? level.last : (d > 1 ? levels[d - 2].last : _parent);
+
+        next_bfs_node = prev_bfs_node->_next_bfs;
+      }
+
+      range.first->_prev_bfs = prev_bfs_node;
+      prev_bfs_node->_next_bfs = range.first;
+      range.last->_next_bfs = next_bfs_node;
+      if (next_bfs_node)
+        next_bfs_node->_prev_bfs = range.last;
+
+      // The parents of the range precede the next parent of the level, whose children follow the next range
+      auto& parents = level.parents;
+      auto const it = next_bfs_node && next_bfs_node->_depth == d ? parents.lower_bound(next_bfs_node) : parents.end();
+      next_parent = it != parents.end() ? *it : nullptr;
+
+      _level_insert(range.first, range.last, _width_unknown, _size, level, [&](TreeNode* p)
+      {
+        p->_depth += depth_shift;
+        if (p->_child_last)
+          parent_nodes.insert(parents, it, p);
+      });
     }
   }
 
-  TreeNode<T> _copy() const noexcept
+  // The bfs ranges of the subtree's levels, from the node's own level (on the root: the level index)
+  std::vector<_LevelRange> _descendant_ranges()
   {
-    TreeNode<T> root(get());
-    _copy_segment(&root);
-    return root;
+    if (_parent)
+      return _subtree_ranges(*_root()->_levels);
+
+    std::vector<_LevelRange> ranges = { { this, this } };
+    for (auto const& level : *_levels)
+      if (level.first)
+        ranges.push_back({ level.first, level.last });
+
+    return ranges;
   }
 
-  TreeNode<T>* _setup_child(std::unique_ptr<TreeNode<T>>&& node) noexcept
+  // Relinks the children in comp order, the bfs chain is not touched
+  template<typename Compare>
+  void _sort_segment(Compare& comp)
   {
-    TreeNode<T>* child = nullptr;
-    if (child_last())
+    std::vector<TreeNode*> children;
+    for (auto child = child_first(); child; child = child->next())
+      children.push_back(child);
+
+    std::stable_sort(children.begin(), children.end(), [&comp](TreeNode const* l, TreeNode const* r) { return comp(l->data, r->data); });
+
+    _child_first.release();
+    for (auto child : children)
+      child->_next.release();
+
+    _child_first.reset(children.front());
+    children.front()->_prev = nullptr;
+    for (size_t i = 1; i < children.size(); ++i)
     {
-      auto last = child_last();
-      last->_next.swap(node);
-      child = last->next();
+      children[i - 1]->_next.reset(children[i]);
+      children[i]->_prev = children[i - 1];
+    }
+
+    children.back()->_next.reset();
+    _child_last = children.back();
 
-      child->_prev = last;
-      child->_prev_bfs = last;
-      child->_next_bfs = last->_next_bfs;
-      if (child->_next_bfs)
-        child->_next_bfs->_prev_bfs = child;
+    this->_rank_clear();
+    for (auto child : children)
+      this->_rank_insert(child);
+  }
+
+  template<typename Compare, typename TForEach>
+  void _sort_all_segments(Compare& comp, TForEach&& for_each)
+  {
+    if (!_child_first)
+      return;
 
-      last->_next_bfs = child;
+    // The parents are taken from the level index, the segments are disjoint
+    auto const ranges = _descendant_ranges();
+    auto const& levels = *_root()->_levels;
+    std::vector<TreeNode*> parents = { this };
+    for (size_t k = 1; k < ranges.size(); ++k)
+    {
+      auto const& level_parents = levels[_depth + k - 1].parents;
+      parents.insert(parents.end(), level_parents.lower_bound(ranges[k].first), level_parents.upper_bound(ranges[k].last));
     }
-    else
+
+    try
+    {
+      for_each(parents.begin(), parents.end(), [&comp](TreeNode* parent) { parent->_sort_segment(comp); });
+    }
+    catch (...)
     {
-      _child_first.swap(node);
-      child = child_first();
+      _relink_descendants(ranges); // the segments sorted so far are kept
+      throw;
+    }
 
-      auto const depth_this = get_depth();
+    _relink_descendants(ranges);
+  }
 
-      auto prev_bfs_node = this;
-      auto next_bfs_node = this->_next_bfs;
-      while (next_bfs_node)
+  // Rebuilds the bfs chain of the descendants from the sibling lists level by level: the new order of a level is the children of the previous level in its new order.
+  // The former labels of a level are reused in the new order, the parent entries of the level are rewritten in place. The sizes, depths and widths are unchanged, the dfs threads are rebuilt.
+  void _relink_descendants(std::vector<_LevelRange> const& ranges)
+  {
+    auto& levels = *_root()->_levels;
+    std::vector<uint64_t> labels;
+    auto upper_first = this;
+    auto upper_last = this;
+    for (size_t k = 1; k < ranges.size(); ++k)
+    {
+      auto const& range = ranges[k];
+      auto& level = levels[_depth + k - 1];
+      auto const prev_bfs_node = range.first->_prev_bfs;
+      auto const next_bfs_node = range.last->_next_bfs;
+
+      labels.clear();
+      for (auto node = range.first; node != next_bfs_node; node = node->_next_bfs)
+        labels.push_back(node->_label);
+
+      // The parent entries of the range are rewritten in place (the set nodes are kept, there is no allocation): the k-th entry gets the k-th parent of the new order.
+      // Invariant: the range keeps its former labels in increasing order, so the rewritten entries are ordered by _LabelLess as well and they stay between the untouched entries before and after the range.
+      // The set is not searched until the level is done.
+      auto& parents = level.parents;
+      auto entry = parents.lower_bound(range.first);
+
+      auto prev = prev_bfs_node;
+      auto label = labels.begin();
+      for (auto upper = upper_first; ; upper = upper->_next_bfs)
       {
-        auto const depth_p = next_bfs_node->get_depth();
-          
-        if (depth_p == depth_this && next_bfs_node->_child_last)
+        for (auto child = upper->child_first(); child; child = child->next())
         {
-          prev_bfs_node = next_bfs_node;
-          next_bfs_node = next_bfs_node->child_first();
-          break;
+          child->_prev_bfs = prev;
+          prev->_next_bfs = child;
+          child->_label = *label++;
+          if (child->_child_last)
+          {
+            assert(("The parent entries keep their order!", entry != parents.end() && (entry == parents.begin() || _LabelLess{}(*std::prev(entry), child))));
+            const_cast<TreeNode*&>(*entry++) = child;
+          }
+
+          prev = child;
         }
-          
-        if (depth_p > depth_this + 1)
-          break;
 
-        prev_bfs_node = next_bfs_node;
-        next_bfs_node = next_bfs_node->_parent->_child_last;
-        if (depth_p == depth_this + 1 && !next_bfs_node)
+        if (upper == upper_last)
           break;
-
-        prev_bfs_node = next_bfs_node;
-        next_bfs_node = next_bfs_node->_next_bfs;
       }
 
+      assert(("The parent entries keep their order!", entry == parents.end() || entry == parents.begin() || _LabelLess{}(*std::prev(entry), *entry)));
 
+      prev->_next_bfs = next_bfs_node;
       if (next_bfs_node)
-      {
-        child->_next_bfs = next_bfs_node;
-        child->_prev_bfs = next_bfs_node->_prev_bfs;
-        next_bfs_node->_prev_bfs->_next_bfs = child;
-        next_bfs_node->_prev_bfs = child;
-      }
-      else
-      {
-        prev_bfs_node->_next_bfs = child;
-        child->_prev_bfs = prev_bfs_node;
-      }
-    }
+        next_bfs_node->_prev_bfs = prev;
 
-    _child_last = child;
-    child->_parent = this;
+      if (level.first == range.first)
+        level.first = prev_bfs_node->_next_bfs;
 
-    change_size(1);
+      if (level.last == range.last)
+        level.last = prev;
+
+      upper_first = prev_bfs_node->_next_bfs;
+      upper_last = prev;
+    }
 
-    return child;
+    _dfs_relink();
+    _Ancestry::_ancestry_respread(this);
   }
 
-public:
-  TreeNode<T>* add_child(T const& d) noexcept
+  // The subtree is relinked after prev (or as the first child) of parent
+  void _move_subtree(TreeNode* parent, TreeNode* prev)
   {
-    return _setup_child(std::make_unique<TreeNode<T>>(d));
+    assert(("Root cannot be moved!", _parent));
+    for (auto p = parent; p; p = p->_parent)
+      assert(("The subtree cannot be moved under itself!", p != this));
+
+    _flush_batch();
+    auto& levels_source = *_root()->_levels;
+    auto const ranges = _subtree_ranges(levels_source);
+    auto const root = parent->_root();
+    auto& levels = root->_get_levels(parent->_depth + ranges.size());
+
+    // The allocations and the key index entry of the new place come first (the key may throw), the tree is unchanged if they throw
+    auto const is_new_parent = parent->_depth > 0 && !parent->_child_last;
+    _ParentNodes parent_nodes;
+    _KeyEntry key_entry{};
+    try
+    {
+      parent_nodes.reserve(_parent_count(levels_source, ranges), 0);
+      if (is_new_parent)
+        levels[parent->_depth - 1].parents.insert(parent);
+
+      key_entry = parent->_key_emplace(this); // the last fallible step
+    }
+    catch (...)
+    {
+      if (is_new_parent)
+        levels[parent->_depth - 1].parents.erase(parent);
+
+      _trim_levels(levels);
+      throw;
+    }
+
+    _dfs_splice_out();
+    _unlink_subtree(levels_source, ranges, parent_nodes);
+    auto node = _unlink_sibling();
+
+    auto& container = prev ? prev->_next : parent->_child_first;
+    _parent = parent;
+    _prev = prev;
+    _next = std::move(container);
+    if (_next)
+      _next->_prev = this;
+    else
+      parent->_child_last = this;
+
+    container = std::move(node);
+    parent->_key_link(this, key_entry);
+    parent->_rank_insert(this);
+    _dfs_splice_in();
+    _link_subtree(levels, ranges, parent_nodes);
+    _Ancestry::_ancestry_link(this, this, 2 * _size);
+    parent->change_size(static_cast<int>(_size));
+    _Aggregate::_aggregate_add(parent, _Aggregate::_aggregate_get(this));
+
+    _trim_levels(levels_source);
   }
-  
-  TreeNode<T>* add_child(T&& d) noexcept
+
+  struct _Reclaimer
+  {
+    std::mutex mutex;
+    std::vector<_NodePtr> subtrees;
+    size_t node_num = 0;
+    std::atomic<Reclamation> mode{ Reclamation::immediate };
+
+    // The static storage of the allocator (e.g. TreeNodePool) is constructed before the reclaimer by a node allocation,
+    // so it is destroyed after it: the subtrees which are still queued at exit are destroyed by the destructor.
+    _Reclaimer() noexcept
+    {
+      allocator_type allocator;
+      try
+      {
+        _allocator_traits::deallocate(allocator, _allocator_traits::allocate(allocator, 1), 1);
+      }
+      catch (...) {} // Out of memory: TreeNodePool is constructed before its allocation fails
+    }
+  };
+
+  static _Reclaimer& _reclaimer() noexcept
   {
-    return _setup_child(std::make_unique<TreeNode<T>>(d));
+    static _Reclaimer reclaimer;
+    return reclaimer;
   }
 
+  // Size and aggregate growth of a marked node in a batch update
+  struct _Pending
+  {
+    TreeNode* node;
+    TreeNode* root;
+    size_t n;
+    aggregate_type part;
+    bool is_applied = false; // to the node
+    bool is_passed = false; // to the parent (merged into its entry)
+  };
+
+  struct _Batch
+  {
+    size_t guard_num = 0;
+    std::vector<_Pending> pending;
+    std::unordered_map<TreeNode const*, size_t> indices; // of pending
 
-  static inline void swap(TreeNode<T>* node1, TreeNode<T>* node2) { std::swap(node1->get(), node2->get()); }
-  inline void swap(TreeNode<T>* node2) { swap(this, node2); }
+    ~_Batch() { _is_batch_destroyed() = true; }
+  };
 
-  void clear() noexcept
+  static _Batch& _batch() noexcept
   {
-    if (_parent)
-      for (auto n = child_first(); n != nullptr; n = n->next())
-        n->clear();
+    static thread_local _Batch batch;
+    return batch;
+  }
 
-    if (!_child_last)
+  // Trivially destructible: the static destructors run after the thread local ones, they can still read it (e.g. the reclaimer, whose queued roots flush the batch)
+  static bool& _is_batch_destroyed() noexcept
+  {
+    static thread_local bool is_destroyed = false;
+    return is_destroyed;
+  }
+
+  // The pending growths are added level by level from the deepest one, the growth of a node is merged into its parent's, so every ancestor is updated once.
+  // If the level buckets or a new parent entry cannot be allocated, the rest of the growths are added ancestor by ancestor (without allocation).
+  static void _flush_batch() noexcept
+  {
+    if (_is_batch_destroyed())
+      return;
+
+    auto& batch = _batch();
+    if (batch.pending.empty())
       return;
 
-    if (_child_last->_next_bfs)
-      _child_last->_next_bfs->_prev_bfs = child_first()->_prev_bfs;
+    try
+    {
+      std::vector<std::vector<size_t>> levels;
+      for (size_t i = 0; i < batch.pending.size(); ++i)
+      {
+        auto const depth = batch.pending[i].node->_depth;
+        if (levels.size() <= depth)
+          levels.resize(depth + 1);
+
+        levels[depth].push_back(i);
+      }
 
-    if (child_first()->_prev_bfs)
-      child_first()->_prev_bfs->_next_bfs = _child_last->_next_bfs;
+      for (auto depth = levels.size(); depth > 0; --depth)
+        for (auto const i : levels[depth - 1])
+        {
+          auto const node = batch.pending[i].node;
+          node->_size += batch.pending[i].n;
+          _Aggregate::_aggregate_combine(node, batch.pending[i].part);
+          batch.pending[i].is_applied = true;
+
+          auto const parent = node->_parent;
+          if (!parent)
+            continue;
+
+          auto const it = batch.indices.find(parent);
+          if (it == batch.indices.end())
+          {
+            batch.pending.push_back({ parent, batch.pending[i].root, batch.pending[i].n, batch.pending[i].part });
+            batch.pending[i].is_passed = true;
+            batch.indices.emplace(parent, batch.pending.size() - 1);
+            levels[depth - 2].push_back(batch.pending.size() - 1);
+          }
+          else
+          {
+            auto& pending = batch.pending[it->second];
+            pending.n += batch.pending[i].n;
+            _Aggregate::_aggregate_combine(pending.part, batch.pending[i].part);
+            batch.pending[i].is_passed = true;
+          }
+        }
+    }
+    catch (...)
+    {
+      for (auto& pending : batch.pending)
+      {
+        if (!pending.is_applied)
+        {
+          pending.node->_size += pending.n;
+          _Aggregate::_aggregate_combine(pending.node, pending.part);
+        }
 
-    _child_first.reset(nullptr);
-    _child_last = nullptr;
+        auto const parent = pending.node->_parent;
+        if (!pending.is_passed && parent)
+        {
+          parent->change_size(static_cast<int>(pending.n));
+          _Aggregate::_aggregate_add(parent, pending.part);
+        }
+      }
+    }
 
-    change_size(static_cast<int>(1 - _size));
+    batch.pending.clear();
+    batch.indices.clear();
   }
 
-  void remove() noexcept
+  // The unlinked chain of n nodes is destroyed or queued for reclaim() by the reclamation mode
+  static void _release(_NodePtr chain, size_t n) noexcept
   {
-    if (!_parent)
-    {
-      assert(("Root cannot be removed!", false));
+    if (!chain)
       return;
-    }
-
-    clear();
-    change_size(-1);
-
-    // Bfs rewire
-    if (_next_bfs)
-      _next_bfs->_prev_bfs = _prev_bfs;
-
-    if (_prev_bfs)
-      _prev_bfs->_next_bfs = _next_bfs;
 
-    // Container reset
-    auto& container = _prev ? _prev->_next : _parent->_child_first ;
-    if (_next)
+    if (get_reclamation() == Reclamation::deferred)
     {
-      _next->_prev = _prev;
-      container.reset(_next.release());
+      auto& reclaimer = _reclaimer();
+      std::lock_guard<std::mutex> lock(reclaimer.mutex);
+      try
+      {
+        reclaimer.subtrees.push_back(std::move(chain));
+        reclaimer.node_num += n;
+        return;
+      }
+      catch (...) {} // Out of memory: the chain is kept, it is destroyed immediately
     }
-    else
+
+    _destroy(std::move(chain));
+  }
+
+  // Iterative teardown of a sibling chain and its subtrees: the children are spliced in front of the rest of the chain, so every node is destroyed alone (no recursion).
+  static void _destroy(_NodePtr node) noexcept
+  {
+    while (node)
     {
-      container.reset(nullptr);
+      if (node->_child_first)
+      {
+        node->_child_last->_next = std::move(node->_next);
+        node->_next = std::move(node->_child_first);
+      }
+
+      auto next = std::move(node->_next);
+      node.reset();
+      node = std::move(next);
     }
   }
 
  public:
-  TreeNode<T> const* child_begin_in_depth(size_t depth) const
+  TreeNode const* child_begin_in_depth(size_t depth) const
   {
+    if (!_parent && depth > 0)
+      return _levels && depth <= _levels->size() ? (*_levels)[depth - 1].first : nullptr;
+
     size_t depth_current = 0;
     auto node = this;
 
@@ -308,20 +3455,20 @@ public:
           if (!node)
             return nullptr;
 
-          depth_current = node->get_depth();
+          depth_current = node->_depth - _depth;
         }
       }
     }
     return node;
   }
   
-  TreeNode<T>* child_begin_in_depth(size_t depth)
+  TreeNode* child_begin_in_depth(size_t depth)
   {
-    return const_cast<TreeNode<T>*>(static_cast<const TreeNode<T>*>(this)->child_begin_in_depth(depth)); // Scott Meyers
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->child_begin_in_depth(depth)); // Scott Meyers
   }
 
 
-  TreeNode<T> const* child_end_in_depth(size_t depth) const
+  TreeNode const* child_end_in_depth(size_t depth) const
   {
     if (depth == -1)
       return nullptr;
@@ -329,76 +3476,105 @@ public:
     return child_begin_in_depth(depth + 1); // end: element after the last of level, so the next level begin element
   }
 
-  TreeNode<T>* child_end_in_depth(size_t depth)
+  TreeNode* child_end_in_depth(size_t depth)
+  {
+    return const_cast<TreeNode*>(static_cast<const TreeNode*>(this)->child_end_in_depth(depth)); // Scott Meyers
+  }
+
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  // Deep copy of the subtree, the nodes of a level are copied in parallel by the execution policy
+  template<typename ExecutionPolicy>
+  TreeNode copy(ExecutionPolicy&& policy) const
   {
-    return const_cast<TreeNode<T>*>(static_cast<const TreeNode<T>*>(this)->child_end_in_depth(depth)); // Scott Meyers
+    TreeNode root(data);
+    root._copy(*this, [&policy](auto first, auto last, auto fn) { std::for_each(policy, first, last, fn); });
+    return root;
   }
+#endif
+
+  // Immutable, contiguous snapshot of the subtree (see FlatTree)
+  FlatTree<T> freeze() const { return FlatTree<T>(*this); }
 
 
 public: // Iterators
 
   // Segment iterator begin
   template<typename T_or_NodePtr = T>
-  IteratorSegment<T, T_or_NodePtr> begin_segment() noexcept { return IteratorSegment<T, T_or_NodePtr>(child_first()); }
+  IteratorSegment<T, T_or_NodePtr, TreeNode> begin_segment() noexcept { return IteratorSegment<T, T_or_NodePtr, TreeNode>(child_first()); }
 
   // Segment iterator end
   template<typename T_or_NodePtr = T>
-  IteratorSegment<T, T_or_NodePtr> end_segment() noexcept  { return IteratorSegment<T, T_or_NodePtr>(nullptr); }
+  IteratorSegment<T, T_or_NodePtr, TreeNode> end_segment() noexcept  { return IteratorSegment<T, T_or_NodePtr, TreeNode>(nullptr); }
 
   // Segment iterator begin
   template<typename T_or_NodePtr = T>
-  IteratorSegmentConst<T, T_or_NodePtr> begin_segment() const noexcept { return IteratorSegmentConst<T, T_or_NodePtr>(child_first()); }
+  IteratorSegmentConst<T, T_or_NodePtr, TreeNode> begin_segment() const noexcept { return IteratorSegmentConst<T, T_or_NodePtr, TreeNode>(child_first()); }
 
   // Segment iterator end
   template<typename T_or_NodePtr = T>
-  IteratorSegmentConst<T, T_or_NodePtr> end_segment() const noexcept { return IteratorSegmentConst<T, T_or_NodePtr>(nullptr); }
+  IteratorSegmentConst<T, T_or_NodePtr, TreeNode> end_segment() const noexcept { return IteratorSegmentConst<T, T_or_NodePtr, TreeNode>(nullptr); }
 
 
   // Depth first search begin iterator
   template<typename T_or_NodePtr = T>
-  IteratorDfs<T, T_or_NodePtr> begin_dfs() noexcept { return IteratorDfs<T, T_or_NodePtr>(this); }
+  IteratorDfs<T, T_or_NodePtr, TreeNode> begin_dfs() noexcept { return IteratorDfs<T, T_or_NodePtr, TreeNode>(this); }
 
-  // Depth first search end iterator
+  // Depth first search end iterator: the node after the subtree (nullptr on the root), O(depth)
   template<typename T_or_NodePtr = T>
-  IteratorDfs<T, T_or_NodePtr> end_dfs() noexcept { return IteratorDfs<T, T_or_NodePtr>(nullptr); }
+  IteratorDfs<T, T_or_NodePtr, TreeNode> end_dfs() noexcept { return IteratorDfs<T, T_or_NodePtr, TreeNode>(_dfs_end()); }
 
   // Depth first search begin iterator
   template<typename T_or_NodePtr = T>
-  IteratorDfsConst<T, T_or_NodePtr> begin_dfs() const noexcept { return IteratorDfsConst<T, T_or_NodePtr>(this); }
+  IteratorDfsConst<T, T_or_NodePtr, TreeNode> begin_dfs() const noexcept { return IteratorDfsConst<T, T_or_NodePtr, TreeNode>(this); }
+
+  // Depth first search end iterator: the node after the subtree (nullptr on the root), O(depth)
+  template<typename T_or_NodePtr = T>
+  IteratorDfsConst<T, T_or_NodePtr, TreeNode> end_dfs() const noexcept { return IteratorDfsConst<T, T_or_NodePtr, TreeNode>(_dfs_end()); }
+
+  // Depth first search range of the subtree (begin_dfs(), end_dfs())
+  template<typename T_or_NodePtr = T>
+  TreeNodeRange<IteratorDfs<T, T_or_NodePtr, TreeNode>> subtree_dfs() noexcept { return { begin_dfs<T_or_NodePtr>(), end_dfs<T_or_NodePtr>() }; }
+
+  template<typename T_or_NodePtr = T>
+  TreeNodeRange<IteratorDfsConst<T, T_or_NodePtr, TreeNode>> subtree_dfs() const noexcept { return { begin_dfs<T_or_NodePtr>(), end_dfs<T_or_NodePtr>() }; }
+
+  // Breadth first search range of the subtree: only the nodes of the subtree are visited (see IteratorSubtreeBfsBase), the end is O(1)
+  template<typename T_or_NodePtr = T>
+  TreeNodeRange<IteratorSubtreeBfs<T, T_or_NodePtr, TreeNode>> subtree_bfs() noexcept { return { IteratorSubtreeBfs<T, T_or_NodePtr, TreeNode>(this), IteratorSubtreeBfs<T, T_or_NodePtr, TreeNode>(nullptr) }; }
 
-  // Depth first search end iterator
   template<typename T_or_NodePtr = T>
-  IteratorDfsConst<T, T_or_NodePtr> end_dfs() const noexcept { return IteratorDfsConst<T, T_or_NodePtr>(nullptr); }
+  TreeNodeRange<IteratorSubtreeBfsConst<T, T_or_NodePtr, TreeNode>> subtree_bfs() const noexcept { return { IteratorSubtreeBfsConst<T, T_or_NodePtr, TreeNode>(this), IteratorSubtreeBfsConst<T, T_or_NodePtr, TreeNode>(nullptr) }; }
 
 
   // Breadth first search begin iterator
   template<typename T_or_NodePtr = T>
-  IteratorBfs<T, T_or_NodePtr> begin_bfs(size_t depth = 0) { return IteratorBfs<T, T_or_NodePtr>(child_begin_in_depth(depth)); }
+  IteratorBfs<T, T_or_NodePtr, TreeNode> begin_bfs(size_t depth = 0) { return IteratorBfs<T, T_or_NodePtr, TreeNode>(child_begin_in_depth(depth)); }
 
   // Breadth first search end iterator
   template<typename T_or_NodePtr = T>
-  IteratorBfs<T, T_or_NodePtr> end_bfs(size_t depth = -1) { return IteratorBfs<T, T_or_NodePtr>(child_end_in_depth(depth)); }
+  IteratorBfs<T, T_or_NodePtr, TreeNode> end_bfs(size_t depth = -1) { return IteratorBfs<T, T_or_NodePtr, TreeNode>(child_end_in_depth(depth)); }
 
   // Breadth first search begin iterator
   template<typename T_or_NodePtr = T>
-  IteratorBfsConst<T, T_or_NodePtr> begin_bfs(size_t depth = 0) const noexcept { return IteratorBfsConst<T, T_or_NodePtr>(child_begin_in_depth(depth)); }
+  IteratorBfsConst<T, T_or_NodePtr, TreeNode> begin_bfs(size_t depth = 0) const noexcept { return IteratorBfsConst<T, T_or_NodePtr, TreeNode>(child_begin_in_depth(depth)); }
 
   // Breadth first search end iterator
   template<typename T_or_NodePtr = T>
-  IteratorBfsConst<T, T_or_NodePtr> end_bfs(size_t depth = -1) const noexcept { return IteratorBfsConst<T, T_or_NodePtr>(child_end_in_depth(depth)); }
+  IteratorBfsConst<T, T_or_NodePtr, TreeNode> end_bfs(size_t depth = -1) const noexcept { return IteratorBfsConst<T, T_or_NodePtr, TreeNode>(child_end_in_depth(depth)); }
 
 
   // Begin iterator (using Breadth first traversal)
-  IteratorBfs<T> begin() noexcept { return IteratorBfs<T>(this); }
+  IteratorBfs<T, T, TreeNode> begin() noexcept { return IteratorBfs<T, T, TreeNode>(this); }
 
   // End iterator (using Breadth first traversal)
-  IteratorBfs<T> end() noexcept { return IteratorBfs<T>(nullptr); }
+  IteratorBfs<T, T, TreeNode> end() noexcept { return IteratorBfs<T, T, TreeNode>(nullptr); }
   
   // Begin iterator (using Breadth first traversal)
-  IteratorBfsConst<T> begin() const noexcept { return IteratorBfsConst<T>(this); }
+  IteratorBfsConst<T, T, TreeNode> begin() const noexcept { return IteratorBfsConst<T, T, TreeNode>(this); }
 
   // End iterator (using Breadth first traversal)
-  IteratorBfsConst<T> end() const noexcept { return IteratorBfsConst<T>(nullptr); }
+  IteratorBfsConst<T, T, TreeNode> end() const noexcept { return IteratorBfsConst<T, T, TreeNode>(nullptr); }
 };
 
 
@@ -421,8 +3597,10 @@ public:
   IteratorNodeTreeBase() = default;
   IteratorNodeTreeBase(IteratorNodeTreeBase const&) = default;
   IteratorNodeTreeBase(IteratorNodeTreeBase&&) = default;
+  IteratorNodeTreeBase& operator=(IteratorNodeTreeBase const&) = default;
+  IteratorNodeTreeBase& operator=(IteratorNodeTreeBase&&) = default;
 
-  static_assert(std::is_same<TValueType, T>::value || std::is_same<TValueType, TreeNode<T>*>::value || std::is_same<TValueType, TreeNode<T> const*>::value, "Only the type of data and TreeNode* are allowed.");
+  static_assert(std::is_same<TValueType, T>::value || std::is_same<TValueType, typename std::remove_const<TNode>::type*>::value || std::is_same<TValueType, TNode const*>::value, "Only the type of data and TreeNode* are allowed.");
 
   IteratorNodeTreeBase& operator=(TNode* node)
   {
@@ -430,6 +3608,9 @@ public:
     return *this;
   }
 
+  // The node of the position
+  TNode* node() const noexcept { return _node; }
+
   bool operator==(IteratorNodeTreeBase const& r) const noexcept
   {
     return _node == r._node;
@@ -468,27 +3649,26 @@ public:
 
   IteratorNodeTreeBase& operator+=(size_t const& n)
   {
-    for (int i = 0; i < n; ++i)
-    {
-      assert(("Out of Segment's range!", _node));
-      ++* this;
-    }
+    StepManager::template advance<TNode>(_node, static_cast<ptrdiff_t>(n));
     return *this;
   }
 
   IteratorNodeTreeBase& operator-=(size_t const n)
   {
-    for (int i = 0; i < n; ++i)
-    {
-      assert(("Out of Segment's range!", _node));
-      --* this;
-    }
+    StepManager::template advance<TNode>(_node, -static_cast<ptrdiff_t>(n));
     return *this;
   }
 
   IteratorNodeTreeBase operator+(size_t const n) const { auto it = *this; it += n; return it; }
   IteratorNodeTreeBase operator-(size_t const n) const { auto it = *this; it -= n; return it; }
 
+  // Steps over the descendants of the position (dfs iterators only)
+  IteratorNodeTreeBase& skip_subtree()
+  {
+    StepManager::template skip<TNode>(_node);
+    return *this;
+  }
+
 
 private:
 
@@ -521,7 +3701,74 @@ public:
 };
 
 
-struct StepManagerSegment
+// Forward iterator of the bfs order of a subtree (TreeNode::subtree_bfs()). The subtree's nodes of a level form a contiguous range of the bfs chain,
+// at the end of a range the iterator jumps to the range of the next level by the level index of the root (O(log width)), the other nodes of the levels are not visited.
+template<typename T, typename TValueType, typename TRefAndPointerBase, typename TNode>
+class IteratorSubtreeBfsBase : public IteratorNodeTreeBase<T, TValueType, TRefAndPointerBase, TNode, StepManagerBfs>
+{
+  using _Base = IteratorNodeTreeBase<T, TValueType, TRefAndPointerBase, TNode, StepManagerBfs>;
+
+  TNode* _root = nullptr;
+  TNode* _top = nullptr;
+  TNode* _first = nullptr; // range of the current level
+  TNode* _last = nullptr;
+
+public:
+  using iterator_category = std::forward_iterator_tag;
+
+  IteratorSubtreeBfsBase() = default;
+  IteratorSubtreeBfsBase(TNode* top) noexcept : _Base(top), _root(top ? top->_root() : nullptr), _top(top), _first(top), _last(top) { }
+
+  IteratorSubtreeBfsBase& operator++()
+  {
+    if (this->_node != _last)
+      this->_node = this->_node->next_bfs();
+    else
+    {
+      std::remove_const_t<TNode>::_subtree_level_next(_root, _top, _first, _last);
+      this->_node = _first;
+    }
+    return *this;
+  }
+
+  IteratorSubtreeBfsBase operator++(int)
+  {
+    auto iterator = *this;
+    ++* this;
+    return iterator;
+  }
+
+  IteratorSubtreeBfsBase& operator--() = delete;
+  IteratorSubtreeBfsBase operator--(int) = delete;
+  IteratorSubtreeBfsBase& operator+=(size_t const&) = delete;
+  IteratorSubtreeBfsBase& operator-=(size_t const) = delete;
+  IteratorSubtreeBfsBase operator+(size_t const) const = delete;
+  IteratorSubtreeBfsBase operator-(size_t const) const = delete;
+};
+
+
+// Steps n times by next() / prev() (n < 0)
+struct StepManagerBase
+{
+  template<typename StepManager, typename TNode>
+  static inline void step(TNode*& _node, ptrdiff_t n)
+  {
+    for (; n > 0; --n)
+    {
+      assert(("Out of range!", _node));
+      StepManager::template next<TNode>(_node);
+    }
+
+    for (; n < 0; ++n)
+    {
+      assert(("Out of range!", _node));
+      StepManager::template prev<TNode>(_node);
+    }
+  }
+};
+
+
+struct StepManagerSegment : StepManagerBase
 {
   template<typename TNode>
   static inline void next(TNode*& _node)
@@ -536,62 +3783,83 @@ struct StepManagerSegment
     if (_node)
       _node = _node->prev();
   }
+
+  // Jumps by the sibling index if it is maintained (the end position cannot step back)
+  template<typename TNode>
+  static inline void advance(TNode*& _node, ptrdiff_t n)
+  {
+    _advance(_node, n, std::integral_constant<bool, std::remove_const_t<TNode>::is_indexed_siblings>{});
+  }
+
+private:
+  template<typename TNode>
+  static inline void _advance(TNode*& _node, ptrdiff_t n, std::false_type)
+  {
+    step<StepManagerSegment>(_node, n);
+  }
+
+  template<typename TNode>
+  static inline void _advance(TNode*& _node, ptrdiff_t n, std::true_type)
+  {
+    if (!_node || !_node->parent() || n == 0)
+      return step<StepManagerSegment>(_node, n);
+
+    auto const parent = _node->parent();
+    auto const index = static_cast<ptrdiff_t>(parent->index_of(_node)) + n;
+    assert(("Out of Segment's range!", index >= 0 && index <= static_cast<ptrdiff_t>(parent->child_count())));
+    _node = parent->child_at(static_cast<size_t>(index));
+  }
 };
 
 
-struct StepManagerDfs
+struct StepManagerDfs : StepManagerBase
 {
+  // Jumps by the subtree sizes (the end position cannot step back)
   template<typename TNode>
-  static inline void next(TNode*& _node)
+  static inline void advance(TNode*& _node, ptrdiff_t n)
   {
-    if (!_node)
-      return;
-
-    auto child = _node->child_first();
-    if (child)
-      _node = child;
+    if (_node)
+      _node = _node->advance_dfs(n);
     else
-    {
-      auto n = _node->next();
-      if (n)
-        _node = n;
-      else
-      {
-        auto p = _node->parent();
-        while (p && !p->next())
-          p = p->parent();
-
-        _node = p ? p->next() : nullptr;
-      }
-    }
+      step<StepManagerDfs>(_node, n);
   }
 
+  // To the node after the subtree
   template<typename TNode>
-  static inline void prev(TNode*& _node)
+  static inline void skip(TNode*& _node)
   {
-    if (!_node)
-      return;
+    if (_node)
+      _node = _node->next_dfs_skip();
+  }
 
-    auto prev = _node->prev();
-    if (!prev)
-      _node = _node->parent();
-    else
-    {
-      auto child = prev->child_last();
-      while (child && child->child_last())
-        child = child->child_last();
+  template<typename TNode>
+  static inline void next(TNode*& _node)
+  {
+    if (_node)
+      _node = _node->next_dfs();
+  }
 
-      if (child)
-        _node = child;
-      else
-        _node = prev;
-    }
+  template<typename TNode>
+  static inline void prev(TNode*& _node)
+  {
+    if (_node)
+      _node = _node->prev_dfs();
   }
 };
 
 
-struct StepManagerBfs
+struct StepManagerBfs : StepManagerBase
 {
+  // Jumps by the level widths (the end position cannot step back), the target level is walked: O(height + width) worst case (see TreeNode::advance_bfs())
+  template<typename TNode>
+  static inline void advance(TNode*& _node, ptrdiff_t n)
+  {
+    if (_node)
+      _node = _node->advance_bfs(n);
+    else
+      step<StepManagerBfs>(_node, n);
+  }
+
   template<typename TNode>
   static inline void next(TNode*& _node)
   {
@@ -608,5 +3876,372 @@ struct StepManagerBfs
 };
 
 
+// Immutable snapshot of a TreeNode subtree in structure-of-arrays layout.
+// Nodes are stored in BFS order and addressed by 32-bit indices: the root is 0, the levels and the sibling segments are contiguous index ranges.
+// Every iterator is random access, thus the C++17 parallel algorithms are able to split the ranges.
 template<typename T>
-void swap(TreeNode<T>& l, TreeNode<T>& r){ TreeNode::swap(l, r); }
+class FlatTree
+{
+public:
+  using index_type = uint32_t;
+  static constexpr index_type npos = static_cast<index_type>(-1);
+
+  // Random access iterator over the values, the position is mapped to node index by the optional order (DFS), otherwise it is the node index itself (BFS and segment).
+  class Iterator
+  {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
+
+  private:
+    T const* _values = nullptr;
+    index_type const* _order = nullptr;
+    difference_type _pos = 0;
+
+  public:
+    Iterator() = default;
+    Iterator(T const* values, index_type const* order, difference_type pos) noexcept : _values(values), _order(order), _pos(pos) {}
+
+    // Node index of the current position
+    index_type index() const noexcept { return _order ? _order[_pos] : static_cast<index_type>(_pos); }
+
+    reference operator*() const noexcept { return _values[index()]; }
+    pointer operator->() const noexcept { return &_values[index()]; }
+    reference operator[](difference_type n) const noexcept { return *(*this + n); }
+
+    Iterator& operator++() noexcept { ++_pos; return *this; }
+    Iterator operator++(int) noexcept { auto it = *this; ++_pos; return it; }
+    Iterator& operator--() noexcept { --_pos; return *this; }
+    Iterator operator--(int) noexcept { auto it = *this; --_pos; return it; }
+
+    Iterator& operator+=(difference_type n) noexcept { _pos += n; return *this; }
+    Iterator& operator-=(difference_type n) noexcept { _pos -= n; return *this; }
+    Iterator operator+(difference_type n) const noexcept { auto it = *this; return it += n; }
+    Iterator operator-(difference_type n) const noexcept { auto it = *this; return it -= n; }
+    friend Iterator operator+(difference_type n, Iterator const& it) noexcept { return it + n; }
+    difference_type operator-(Iterator const& r) const noexcept { return _pos - r._pos; }
+
+    bool operator==(Iterator const& r) const noexcept { return _pos == r._pos; }
+    bool operator!=(Iterator const& r) const noexcept { return _pos != r._pos; }
+    bool operator<(Iterator const& r) const noexcept { return _pos < r._pos; }
+    bool operator>(Iterator const& r) const noexcept { return _pos > r._pos; }
+    bool operator<=(Iterator const& r) const noexcept { return _pos <= r._pos; }
+    bool operator>=(Iterator const& r) const noexcept { return _pos >= r._pos; }
+  };
+
+private:
+  std::vector<T> _values;
+  std::vector<index_type> _parent;
+  std::vector<index_type> _child_first;
+  std::vector<index_type> _next;
+  std::vector<index_type> _size;
+  std::vector<index_type> _dfs; // node index of the DFS positions
+  std::vector<index_type> _dfs_position; // DFS position of the node indices
+  std::vector<index_type> _level_offsets; // level d: [_level_offsets[d], _level_offsets[d + 1])
+
+public:
+  FlatTree() = default;
+
+  template<typename TNode>
+  explicit FlatTree(TNode const& root)
+  {
+    auto const n = root.size();
+    assert(("Too many nodes for 32-bit indices!", n < npos));
+
+    std::vector<TNode const*> nodes;
+    nodes.reserve(n);
+    _values.reserve(n);
+    _parent.reserve(n);
+    _child_first.assign(n, npos);
+    _next.assign(n, npos);
+    _size.reserve(n);
+    _dfs.resize(n);
+    _dfs_position.resize(n);
+
+    nodes.push_back(&root);
+    _parent.push_back(npos);
+    _dfs_position[0] = 0;
+    index_type level_end = 0;
+    for (index_type i = 0; i < nodes.size(); ++i)
+    {
+      // Every node of the next level is already collected, when the current one is reached
+      if (i == level_end)
+      {
+        _level_offsets.push_back(i);
+        level_end = static_cast<index_type>(nodes.size());
+      }
+
+      auto const node = nodes[i];
+      _values.push_back(node->get());
+      _size.push_back(static_cast<index_type>(node->size()));
+
+      auto dfs_position = _dfs_position[i] + 1;
+      for (auto child = node->child_first(); child; child = child->next())
+      {
+        auto const j = static_cast<index_type>(nodes.size());
+        if (child == node->child_first())
+          _child_first[i] = j;
+        else
+          _next[j - 1] = j;
+
+        nodes.push_back(child);
+        _parent.push_back(i);
+        _dfs_position[j] = dfs_position;
+        dfs_position += static_cast<index_type>(child->size());
+      }
+    }
+    _level_offsets.push_back(static_cast<index_type>(n));
+
+    for (index_type i = 0; i < n; ++i)
+      _dfs[_dfs_position[i]] = i;
+  }
+
+  size_t size() const noexcept { return _values.size(); }
+  size_t size(index_type i) const noexcept { return _size[i]; }
+  size_t size_segment(index_type i) const noexcept { return _segment_end(i) - _segment_begin(i); }
+
+  // Number of levels
+  size_t height() const noexcept { return _level_offsets.size() - 1; }
+  size_t size_level(size_t depth) const noexcept { return depth < height() ? _level_offsets[depth + 1] - _level_offsets[depth] : 0; }
+
+  size_t get_depth(index_type i) const noexcept
+  {
+    return std::upper_bound(_level_offsets.begin(), _level_offsets.end(), i) - _level_offsets.begin() - 1;
+  }
+
+  T const& get(index_type i) const noexcept { return _values[i]; }
+
+  index_type parent(index_type i) const noexcept { return _parent[i]; }
+  index_type child_first(index_type i) const noexcept { return _child_first[i]; }
+  index_type child_last(index_type i) const noexcept { return _child_first[i] == npos ? npos : _segment_end(i) - 1; }
+  index_type next(index_type i) const noexcept { return _next[i]; }
+  index_type prev(index_type i) const noexcept { return i > 0 && _parent[i - 1] == _parent[i] ? i - 1 : npos; }
+
+  index_type next_bfs(index_type i) const noexcept { return i + 1 < size() ? i + 1 : npos; }
+  index_type prev_bfs(index_type i) const noexcept { return i > 0 ? i - 1 : npos; }
+
+  index_type next_dfs(index_type i) const noexcept { auto const p = _dfs_position[i] + 1; return p < size() ? _dfs[p] : npos; }
+  index_type prev_dfs(index_type i) const noexcept { auto const p = _dfs_position[i]; return p > 0 ? _dfs[p - 1] : npos; }
+
+private:
+  // Siblings are contiguous and the parent indices are non-decreasing in BFS order
+  index_type _segment_begin(index_type i) const noexcept
+  {
+    return _child_first[i] == npos ? 0 : _child_first[i];
+  }
+
+  index_type _segment_end(index_type i) const noexcept
+  {
+    if (_child_first[i] == npos)
+      return 0;
+
+    return static_cast<index_type>(std::upper_bound(_parent.begin() + _child_first[i], _parent.end(), i) - _parent.begin());
+  }
+
+public: // Iterators
+
+  // Segment iterator begin
+  Iterator begin_segment(index_type i = 0) const noexcept { return Iterator(_values.data(), nullptr, _segment_begin(i)); }
+
+  // Segment iterator end
+  Iterator end_segment(index_type i = 0) const noexcept { return Iterator(_values.data(), nullptr, _segment_end(i)); }
+
+
+  // Depth first search begin iterator of the subtree
+  Iterator begin_dfs(index_type i = 0) const noexcept { return Iterator(_values.data(), _dfs.data(), _dfs_position[i]); }
+
+  // Depth first search end iterator of the subtree
+  Iterator end_dfs(index_type i = 0) const noexcept { return Iterator(_values.data(), _dfs.data(), _dfs_position[i] + _size[i]); }
+
+
+  // Breadth first search begin iterator
+  Iterator begin_bfs(size_t depth = 0) const noexcept { return Iterator(_values.data(), nullptr, _level_offsets[std::min(depth, height())]); }
+
+  // Breadth first search end iterator
+  Iterator end_bfs(size_t depth = -1) const noexcept { return Iterator(_values.data(), nullptr, _level_offsets[depth < height() ? depth + 1 : height()]); }
+
+
+  // Begin iterator (using Breadth first traversal)
+  Iterator begin() const noexcept { return begin_bfs(); }
+
+  // End iterator (using Breadth first traversal)
+  Iterator end() const noexcept { return end_bfs(); }
+};
+
+
+template<typename T, typename TAllocator, typename TKeyOf, bool IsIndexedSiblings, bool IsDfsThreaded, typename TAggregate, bool IsAncestryLabeled>
+void swap(TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>& l, TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>& r){ TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>::swap(&l, &r); }
+
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+// Task of the parallel tree algorithms: count consecutive nodes in dfs order from node (a whole subtree or a run of split nodes)
+template<typename TNode>
+struct TreeNodeTask
+{
+  TNode* node;
+  size_t position; // in the dfs order of the root
+  size_t count;
+};
+
+// Splits the tree from the root until the subtrees have at most grain nodes (by their sizes), the split nodes form runs along their first children (at most grain nodes).
+// Only the split nodes are visited. The tasks are in dfs order, so in reverse order the descendants of a split node precede it.
+template<typename TNode>
+std::vector<TreeNodeTask<TNode>> tree_tasks(TNode& root, size_t grain)
+{
+  std::vector<TreeNodeTask<TNode>> tasks;
+  std::vector<std::pair<TNode*, size_t>> stack = { { &root, 0 } };
+  while (!stack.empty())
+  {
+    auto node = stack.back().first;
+    auto const position = stack.back().second;
+    stack.pop_back();
+    if (node->size() <= grain)
+    {
+      tasks.push_back({ node, position, node->size() });
+      continue;
+    }
+
+    // The children are pushed backwards, so the tasks follow the dfs order (the memory of the nodes is usually allocated in that order)
+    auto const run = node;
+    size_t count = 0;
+    for (;;)
+    {
+      ++count;
+      auto const child_first = node->child_first();
+      auto position_child = position + count - 1 + node->size();
+      for (auto child = node->child_last(); child != child_first; child = child->prev())
+      {
+        position_child -= child->size();
+        stack.push_back({ child, position_child });
+      }
+
+      if (!child_first)
+        break;
+
+      if (child_first->size() <= grain || count == grain)
+      {
+        stack.push_back({ child_first, position + count });
+        break;
+      }
+
+      node = child_first;
+    }
+    tasks.push_back({ run, position, count });
+  }
+  return tasks;
+}
+
+// Default grain of the parallel tree algorithms: ~4096 tasks on a large tree, so the scheduler of the execution policy is able to balance skewed trees
+template<typename TNode>
+size_t tree_grain(TNode const& root) noexcept { return std::max<size_t>(root.size() / 4096, 256); }
+
+// Calls f on the data of every node of the subtree of root, the subtree tasks (see tree_tasks()) are distributed by the execution policy
+template<typename ExecutionPolicy, typename TNode, typename Function, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+void tree_for_each(ExecutionPolicy&& policy, TNode& root, Function f)
+{
+  auto const tasks = tree_tasks(root, tree_grain(root));
+  std::for_each(policy, tasks.begin(), tasks.end(), [&f](auto const& task)
+  {
+    auto node = task.node;
+    for (size_t i = 1; i < task.count; ++i, node = node->next_dfs())
+      f(node->get());
+
+    f(node->get());
+  });
+}
+
+// Writes f(data) of the nodes of the subtree of root to d_first in dfs order (d_first[dfs_index] = f(data)), the subtree tasks are distributed by the execution policy. Returns the end of the output.
+template<typename ExecutionPolicy, typename TNode, typename TRandomIterator, typename UnaryOperation, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+TRandomIterator tree_transform(ExecutionPolicy&& policy, TNode& root, TRandomIterator d_first, UnaryOperation op)
+{
+  auto const tasks = tree_tasks(root, tree_grain(root));
+  std::for_each(policy, tasks.begin(), tasks.end(), [&op, d_first](auto const& task)
+  {
+    auto it = d_first + static_cast<ptrdiff_t>(task.position);
+    auto node = task.node;
+    for (size_t i = 1; i < task.count; ++i, node = node->next_dfs())
+      *it++ = op(node->get());
+
+    *it = op(node->get());
+  });
+  return d_first + static_cast<ptrdiff_t>(root.size());
+}
+
+// Result type of fold_up()
+template<typename TNode, typename TLeafFn>
+using tree_fold_result_t = std::decay_t<decltype(std::declval<TLeafFn&>()(std::declval<TNode&>().get()))>;
+
+// Bottom-up fold of the subtree of root without recursion: the result of a node is leaf_fn(data) combined with the results of its children in order by combine_fn(result, result_child).
+// The results are written to results[dfs index] and passed to on_result(node, result), the root's result is returned.
+// The subtree tasks (see tree_tasks()) are folded in parallel by the execution policy (on_result is called concurrently), then the split nodes bottom-up.
+template<typename ExecutionPolicy, typename TNode, typename TLeafFn, typename TCombineFn, typename TRandomIterator, typename TResultCallback, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>>>>
+tree_fold_result_t<TNode, TLeafFn> fold_up(ExecutionPolicy&& policy, TNode& root, TLeafFn leaf_fn, TCombineFn combine_fn, TRandomIterator results, TResultCallback on_result)
+{
+  auto const fold = [&](TNode* node, size_t position)
+  {
+    auto result = leaf_fn(node->get());
+    auto position_child = position + 1;
+    for (auto child = node->child_first(); child; child = child->next())
+    {
+      result = combine_fn(std::move(result), results[static_cast<ptrdiff_t>(position_child)]);
+      position_child += child->size();
+    }
+
+    on_result(*node, static_cast<tree_fold_result_t<TNode, TLeafFn> const&>(result));
+    results[static_cast<ptrdiff_t>(position)] = std::move(result);
+  };
+
+  // The subtrees are walked backwards in dfs order, so the children are folded before their parent
+  auto const tasks = tree_tasks(root, tree_grain(root));
+  std::for_each(policy, tasks.begin(), tasks.end(), [&fold](auto const& task)
+  {
+    if (task.count != task.node->size())
+      return;
+
+    auto node = task.node;
+    while (node->child_last())
+      node = node->child_last();
+
+    for (auto position = task.position + task.count - 1; position != task.position; --position, node = node->prev_dfs())
+      fold(node, position);
+
+    fold(node, task.position);
+  });
+
+  // The runs of the split nodes follow their first children, the descendants of a run precede it in reverse task order
+  for (auto it = tasks.rbegin(); it != tasks.rend(); ++it)
+  {
+    if (it->count == it->node->size())
+      continue;
+
+    auto node = it->node;
+    for (size_t i = 1; i < it->count; ++i)
+      node = node->child_first();
+
+    for (auto position = it->position + it->count - 1; position != it->position; --position, node = node->parent())
+      fold(node, position);
+
+    fold(node, it->position);
+  }
+
+  return results[0];
+}
+
+// Bottom-up fold, the results are written to results[dfs index] (see above)
+template<typename ExecutionPolicy, typename TNode, typename TLeafFn, typename TCombineFn, typename TRandomIterator, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>> && !std::is_invocable_v<TRandomIterator&, TNode&, tree_fold_result_t<TNode, TLeafFn> const&>>>
+tree_fold_result_t<TNode, TLeafFn> fold_up(ExecutionPolicy&& policy, TNode& root, TLeafFn leaf_fn, TCombineFn combine_fn, TRandomIterator results)
+{
+  return fold_up(policy, root, leaf_fn, combine_fn, results, [](TNode&, tree_fold_result_t<TNode, TLeafFn> const&) {});
+}
+
+// Bottom-up fold, the results are passed to on_result(node, result) (see above, the results are buffered internally)
+template<typename ExecutionPolicy, typename TNode, typename TLeafFn, typename TCombineFn, typename TResultCallback, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecutionPolicy>> && std::is_invocable_v<TResultCallback&, TNode&, tree_fold_result_t<TNode, TLeafFn> const&>>, typename = void>
+tree_fold_result_t<TNode, TLeafFn> fold_up(ExecutionPolicy&& policy, TNode& root, TLeafFn leaf_fn, TCombineFn combine_fn, TResultCallback on_result)
+{
+  std::vector<tree_fold_result_t<TNode, TLeafFn>> results(root.size());
+  return fold_up(policy, root, leaf_fn, combine_fn, results.begin(), on_result);
+}
+#endif
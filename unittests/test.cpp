@@ -4,6 +4,7 @@
 #include "../treenode.h"
 
 #include <vector>
+#include <thread>
 
 #if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
   #include <execution>
@@ -38,6 +39,20 @@ namespace TreeNodeTests
     EXPECT_EQ(1, node->get().val);
   }
 
+  TEST(TreeNode, swap_free_function_DataIsSwapped)
+  {
+    TreeNode<DbEntity> root;
+    auto const n1 = root.add_child(DbEntity{ 1 });
+    auto const n2 = root.add_child(DbEntity{ 2 });
+    n1->add_child(DbEntity{ 11 });
+
+    swap(*n1, *n2);
+    EXPECT_EQ(2, n1->get().val);
+    EXPECT_EQ(1, n2->get().val);
+    EXPECT_EQ(11, n1->child_first()->get().val);
+    EXPECT_EQ(nullptr, n2->child_first());
+  }
+
   TEST(TreeNode, add_child_1child_PrevIsNull)
   {
     TreeNode<DbEntity> root;
@@ -1277,4 +1292,2826 @@ namespace IteratorBreadthFirstSearchTests
     auto const expected = vector<int>{ 0, 1, 2, 3, 11, 21, 22, 31, 111, 311 };
     EXPECT_EQ(expected, vals);
   }
-}
\ No newline at end of file
+}
+
+
+namespace TreeNodeAllocatorTests
+{
+  using namespace std;
+
+  int& allocated_node_num() { static int n = 0; return n; }
+  int& allocated_other_num() { static int n = 0; return n; } // level index
+
+  template<typename T>
+  struct IsTreeNode : false_type {};
+
+  template<typename T, typename TAllocator, typename TKeyOf, bool IsIndexedSiblings, bool IsDfsThreaded, typename TAggregate, bool IsAncestryLabeled>
+  struct IsTreeNode<TreeNode<T, TAllocator, TKeyOf, IsIndexedSiblings, IsDfsThreaded, TAggregate, IsAncestryLabeled>> : true_type {};
+
+  template<typename T>
+  int& allocated_num() { return IsTreeNode<T>::value ? allocated_node_num() : allocated_other_num(); }
+
+  // While it is set, the allocations other than the nodes fail
+  bool& is_other_failing() { static bool is_failing = false; return is_failing; }
+
+  template<typename T>
+  struct CountingAllocator
+  {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = CountingAllocator<U>; };
+
+    CountingAllocator() = default;
+
+    template<typename U>
+    CountingAllocator(CountingAllocator<U> const&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+      if (!IsTreeNode<T>::value && is_other_failing())
+        throw bad_alloc();
+
+      allocated_num<T>() += static_cast<int>(n);
+      return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p, size_t n) noexcept { allocated_num<T>() -= static_cast<int>(n); std::allocator<T>().deallocate(p, n); }
+  };
+
+  template<typename T, typename U>
+  bool operator==(CountingAllocator<T> const&, CountingAllocator<U> const&) { return true; }
+
+  template<typename T, typename U>
+  bool operator!=(CountingAllocator<T> const&, CountingAllocator<U> const&) { return false; }
+
+
+  struct PoolBlock
+  {
+    void* pointers[3];
+  };
+
+  TEST(TreeNodePool, deallocate_allocate_recycled)
+  {
+    using Pool = TreeNodePool<PoolBlock>;
+    auto p1 = Pool::allocate();
+    Pool::deallocate(p1);
+    auto p2 = Pool::allocate();
+
+    EXPECT_EQ(p1, p2);
+    Pool::deallocate(p2);
+  }
+
+  TEST(TreeNodePool, release_only_unused)
+  {
+    struct OtherBlock { void* pointers[3]; };
+    using Pool = TreeNodePool<PoolBlock>;
+    using OtherPool = TreeNodePool<OtherBlock>;
+
+    auto const p = Pool::allocate();
+    auto const other = OtherPool::allocate();
+    EXPECT_EQ(1, Pool::size());
+
+    // Deallocated on another thread, it is counted there
+    thread([other] { OtherPool::deallocate(other); }).join();
+    EXPECT_EQ(0, OtherPool::size());
+    EXPECT_TRUE(OtherPool::release());
+
+    EXPECT_FALSE(Pool::release());
+    Pool::deallocate(p);
+    EXPECT_TRUE(Pool::release());
+  }
+
+  TEST(TreeNodePoolAllocator, release_keeps_live_trees)
+  {
+    struct Other { int value; };
+    using TN = TreeNode<int, TreeNodePoolAllocator<int>, void, false, false, void, true>;
+    using TNOther = TreeNode<Other, TreeNodePoolAllocator<Other>, void, false, false, void, true>;
+    static_assert(sizeof(TN) == sizeof(TNOther), "Same node size, separate pools");
+    {
+      TN root(0);
+      root.add_child(1)->add_child(11);
+      {
+        TNOther other(Other{ 0 });
+        other.add_child(Other{ 1 });
+      }
+
+      EXPECT_TRUE(TNOther::allocator_type::release()); // the nodes of root are in another pool, they are untouched
+      EXPECT_FALSE(TN::allocator_type::release());
+      EXPECT_EQ(11, root.child_first()->child_first()->get());
+      EXPECT_EQ(3, root.size());
+    }
+    EXPECT_TRUE(TN::allocator_type::release());
+  }
+
+  TEST(TreeNodePoolAllocator, remove_add_child_recycled)
+  {
+    TreeNode<int> root(0);
+    root.add_child(1);
+    auto c2 = root.add_child(2);
+    c2->add_child(21);
+
+    auto const p21 = c2->child_first();
+    c2->clear();
+    auto const c22 = c2->add_child(22);
+
+    EXPECT_EQ(p21, c22);
+    EXPECT_EQ(4, root.size());
+  }
+
+  TEST(TreeNode, allocator_std_bfs)
+  {
+    TreeNode<int, std::allocator<int>> root(0);
+    root.add_child(1)->add_child(11);
+    root.add_child(2)->add_child(21);
+    root.child_first()->remove();
+
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+
+    auto const expected = vector<int>{ 0, 2, 21 };
+    EXPECT_EQ(expected, vals);
+  }
+
+  TEST(TreeNode, allocator_custom_balanced)
+  {
+    using TN = TreeNode<int, CountingAllocator<int>>;
+    {
+      TN root(0);
+      root.add_child(1)->add_child(11);
+      auto c2 = root.add_child(2);
+      c2->add_child(21);
+      EXPECT_EQ(4, allocated_node_num());
+
+      c2->remove();
+      EXPECT_EQ(2, allocated_node_num());
+
+      vector<TN*> nodes;
+      copy(root.begin_bfs<TN*>(), root.end_bfs<TN*>(), back_inserter(nodes));
+      EXPECT_EQ(3, nodes.size());
+    }
+    EXPECT_EQ(0, allocated_node_num());
+  }
+
+  TEST(TreeNode, allocator_custom_level_index)
+  {
+    using TN = TreeNode<int, CountingAllocator<int>>;
+    auto const n_before = allocated_other_num();
+    {
+      TN root(0);
+      root.add_child(1)->add_child(11)->add_child(111);
+      EXPECT_LT(n_before, allocated_other_num()); // the level index and its parent entries come from TAllocator as well
+
+      auto detached = root.child_first()->detach();
+      EXPECT_EQ(3, detached.size());
+      EXPECT_EQ(3, detached.get_height());
+    }
+    EXPECT_EQ(n_before, allocated_other_num());
+    EXPECT_EQ(0, allocated_node_num());
+  }
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  TEST(TreeNode, allocator_failure_move_graft_tree_unchanged)
+  {
+    using TN = TreeNode<int, CountingAllocator<int>>;
+    TN root(0);
+    auto const n1 = root.add_child(1);
+    auto const n11 = n1->add_child(11);
+    n11->add_child(111);
+    auto const n12 = n1->add_child(12);
+    auto const n2 = root.add_child(2);
+    auto const n21 = n2->add_child(21);
+
+    TN other(3);
+    other.add_child(31)->add_child(311);
+
+    is_other_failing() = true;
+    EXPECT_THROW(n11->move_to(n2), bad_alloc);
+    EXPECT_THROW(n12->move_to(n21), bad_alloc); // n21 would be a new parent
+    EXPECT_THROW(n21->graft(std::move(other)), bad_alloc);
+    n12->move_to(n2); // a leaf under a parent: no allocation
+    is_other_failing() = false;
+
+    EXPECT_EQ(7, root.size());
+    EXPECT_EQ(4, root.get_height());
+    EXPECT_EQ(vector<int>({ 0, 1, 11, 111, 2, 21, 12 }), vector<int>(root.begin_dfs(), root.end_dfs()));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 11, 21, 12, 111 }), vector<int>(root.begin_bfs(), root.end_bfs()));
+    EXPECT_EQ(3, other.size());
+
+    n11->move_to(n21);
+    n2->graft(std::move(other));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 21, 11, 111, 12, 3, 31, 311 }), vector<int>(root.begin_dfs(), root.end_dfs()));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 21, 12, 3, 11, 31, 111, 311 }), vector<int>(root.begin_bfs(), root.end_bfs()));
+    EXPECT_EQ(5, root.get_height());
+  }
+#endif
+}
+
+
+
+namespace FlatTreeTests
+{
+  using namespace std;
+
+  TreeNode<int> CreateTree()
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)
+      ->add_child(11)
+      ->add_child(111);
+    auto n2 = root.add_child(2);
+    n2->add_child(21);
+    root.add_child(3)
+      ->add_child(31)
+      ->add_child(311);
+    n2->add_child(22);
+
+    return root;
+  }
+
+  TEST(FlatTree, freeze_structure)
+  {
+    auto const root = CreateTree();
+    auto const flat = root.freeze();
+
+    EXPECT_EQ(10, flat.size());
+    EXPECT_EQ(4, flat.height());
+    EXPECT_EQ(FlatTree<int>::npos, flat.parent(0));
+    EXPECT_EQ(1, flat.child_first(0));
+    EXPECT_EQ(3, flat.child_last(0));
+    EXPECT_EQ(2, flat.next(1));
+    EXPECT_EQ(FlatTree<int>::npos, flat.next(3));
+    EXPECT_EQ(2, flat.parent(5));
+    EXPECT_EQ(3, flat.size(2));
+    EXPECT_EQ(2, flat.size_segment(2));
+    EXPECT_EQ(4, flat.size_level(2));
+    EXPECT_EQ(3, flat.get_depth(9));
+  }
+
+  TEST(FlatTree, bfs_order)
+  {
+    auto const flat = CreateTree().freeze();
+
+    vector<int> vals(flat.begin(), flat.end());
+    auto const expected = vector<int>{ 0, 1, 2, 3, 11, 21, 22, 31, 111, 311 };
+    EXPECT_EQ(expected, vals);
+
+    vector<int> vals_level2(flat.begin_bfs(2), flat.end_bfs(2));
+    auto const expected_level2 = vector<int>{ 11, 21, 22, 31 };
+    EXPECT_EQ(expected_level2, vals_level2);
+  }
+
+  TEST(FlatTree, dfs_order)
+  {
+    auto const root = CreateTree();
+    auto const flat = root.freeze();
+
+    vector<int> vals(flat.begin_dfs(), flat.end_dfs());
+    vector<int> expected;
+    copy(root.begin_dfs(), root.end_dfs(), back_inserter(expected));
+    EXPECT_EQ(expected, vals);
+
+    vector<int> vals_subtree(flat.begin_dfs(2), flat.end_dfs(2));
+    auto const expected_subtree = vector<int>{ 2, 21, 22 };
+    EXPECT_EQ(expected_subtree, vals_subtree);
+    EXPECT_EQ(2, (flat.begin_dfs() + 4).index());
+  }
+
+  TEST(FlatTree, segment_random_access)
+  {
+    auto const flat = CreateTree().freeze();
+
+    auto const it = flat.begin_segment(2);
+    EXPECT_EQ(2, flat.end_segment(2) - it);
+    EXPECT_EQ(22, it[1]);
+    EXPECT_EQ(flat.end_segment(5), flat.begin_segment(5));
+  }
+
+  TEST(FlatTree, subnode_freeze)
+  {
+    auto const root = CreateTree();
+    auto const flat = root.child_first()->next()->freeze();
+
+    vector<int> vals(flat.begin(), flat.end());
+    auto const expected = vector<int>{ 2, 21, 22 };
+    EXPECT_EQ(expected, vals);
+  }
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  TEST(FlatTree, transform_par)
+  {
+    auto const flat = CreateTree().freeze();
+
+    vector<int> vals(flat.size());
+    transform(std::execution::par, flat.begin_dfs(), flat.end_dfs(), vals.begin(), [](auto v) { return v * 2; });
+    EXPECT_EQ(622, vals.back());
+  }
+#endif
+}
+
+
+
+namespace TreeNodeLevelTests
+{
+  using namespace std;
+
+  TEST(TreeNode, level_index_add_child)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c2 = root.add_child(2);
+    auto c21 = c2->add_child(21);
+    auto c11 = c1->add_child(11);
+    auto c111 = c11->add_child(111);
+
+    EXPECT_EQ(4, root.get_height());
+    EXPECT_EQ(1, root.size_level(0));
+    EXPECT_EQ(2, root.size_level(1));
+    EXPECT_EQ(2, root.size_level(2));
+    EXPECT_EQ(0, root.size_level(4));
+    EXPECT_EQ(c1, root.child_begin_in_depth(1));
+    EXPECT_EQ(c2, root.child_last_in_depth(1));
+    EXPECT_EQ(c11, root.child_begin_in_depth(2));
+    EXPECT_EQ(c21, root.child_last_in_depth(2));
+    EXPECT_EQ(c111, root.child_end_in_depth(2));
+    EXPECT_EQ(nullptr, root.child_end_in_depth(3));
+  }
+
+  TEST(TreeNode, level_index_remove)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c2 = root.add_child(2);
+    auto c21 = c2->add_child(21);
+    c1->add_child(11)->add_child(111);
+
+    c1->remove();
+
+    EXPECT_EQ(3, root.get_height());
+    EXPECT_EQ(1, root.size_level(1));
+    EXPECT_EQ(c2, root.child_begin_in_depth(1));
+    EXPECT_EQ(c21, root.child_begin_in_depth(2));
+    EXPECT_EQ(c21, root.child_last_in_depth(2));
+  }
+
+  TEST(TreeNode, level_index_clear)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c2 = root.add_child(2);
+    c2->add_child(21);
+    c2->add_child(22)->add_child(221);
+    auto c11 = c1->add_child(11);
+
+    c2->clear();
+
+    EXPECT_EQ(3, root.get_height());
+    EXPECT_EQ(1, root.size_level(2));
+    EXPECT_EQ(c11, root.child_last_in_depth(2));
+
+    root.clear();
+    EXPECT_EQ(1, root.get_height());
+    EXPECT_EQ(nullptr, root.child_begin_in_depth(1));
+  }
+
+  TEST(TreeNode, level_index_bfs_range)
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)->add_child(11);
+    root.add_child(2)->add_child(21)->add_child(211);
+
+    vector<int> vals;
+    copy(root.begin_bfs(1), root.end_bfs(1), back_inserter(vals));
+
+    auto const expected = vector<int>{ 1, 2 };
+    EXPECT_EQ(expected, vals);
+  }
+
+  TEST(TreeNode, move_ctor_children_adopted)
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)->add_child(11);
+    root.add_child(2);
+
+    TreeNode<int> moved(std::move(root));
+    EXPECT_EQ(&moved, moved.child_first()->parent());
+    EXPECT_EQ(&moved, moved.child_first()->prev_bfs());
+    EXPECT_EQ(3, moved.get_height());
+    EXPECT_EQ(1, root.size());
+
+    moved.child_first()->add_child(12);
+    EXPECT_EQ(5, moved.size());
+  }
+}
+
+
+
+namespace TreeNodeBfsSpliceTests
+{
+  using namespace std;
+
+  TEST(TreeNode, add_child_first_child_before_later_sibling_bfsOk)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c2 = root.add_child(2);
+    auto c3 = root.add_child(3);
+    auto c4 = root.add_child(4);
+    c1->add_child(11);
+    c3->add_child(31);
+    c4->add_child(41);
+
+    c2->add_child(21);
+
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+
+    auto const expected = vector<int>{ 0, 1, 2, 3, 4, 11, 21, 31, 41 };
+    EXPECT_EQ(expected, vals);
+  }
+
+  TEST(TreeNode, add_child_same_gap_many_bfsOk)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c2 = root.add_child(2);
+    c2->add_child(200000);
+
+    for (int i = 0; i < 10000; ++i)
+      c1->add_child(100000 + i);
+
+    c2->add_child(200001);
+
+    vector<int> vals;
+    copy(root.begin_bfs(2), root.end_bfs(2), back_inserter(vals));
+
+    EXPECT_EQ(10002, vals.size());
+    EXPECT_TRUE(is_sorted(vals.begin(), vals.end()));
+  }
+
+  TEST(TreeNode, add_child_wide_reverse_order_bfsOk)
+  {
+    TreeNode<int> root(0);
+    vector<TreeNode<int>*> children;
+    for (int i = 0; i < 1000; ++i)
+      children.push_back(root.add_child(i));
+
+    for (auto it = children.rbegin(); it != children.rend(); ++it)
+      (*it)->add_child(1000 + (*it)->get());
+
+    vector<int> vals;
+    copy(root.begin_bfs(2), root.end_bfs(2), back_inserter(vals));
+
+    EXPECT_EQ(1000, vals.size());
+    EXPECT_TRUE(is_sorted(vals.begin(), vals.end()));
+  }
+}
+
+
+
+namespace TreeNodeDepthTests
+{
+  using namespace std;
+
+  TEST(TreeNode, get_depth_add_child)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c11 = c1->add_child(11);
+    auto c111 = c11->add_child(111);
+    auto c2 = root.add_child(2);
+
+    EXPECT_EQ(0, root.get_depth());
+    EXPECT_EQ(1, c1->get_depth());
+    EXPECT_EQ(2, c11->get_depth());
+    EXPECT_EQ(3, c111->get_depth());
+    EXPECT_EQ(1, c2->get_depth());
+  }
+
+  TEST(TreeNode, get_depth_after_move_and_copy)
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)->add_child(11);
+
+    auto copied = root;
+    auto moved = std::move(root);
+
+    EXPECT_EQ(0, moved.get_depth());
+    EXPECT_EQ(2, moved.child_first()->child_first()->get_depth());
+    EXPECT_EQ(2, copied.child_first()->child_first()->get_depth());
+  }
+
+  TEST(TreeNode, child_begin_in_depth_subnode_relative)
+  {
+    TreeNode<int> root(0);
+    auto c1 = root.add_child(1);
+    auto c11 = c1->add_child(11);
+    c11->add_child(111);
+    auto c2 = root.add_child(2);
+    auto c21 = c2->add_child(21);
+    auto c211 = c21->add_child(211);
+
+    EXPECT_EQ(c21, c2->child_begin_in_depth(1));
+    EXPECT_EQ(c211, c2->child_begin_in_depth(2));
+  }
+}
+
+
+
+namespace TreeNodeCopyTests
+{
+  using namespace std;
+
+  TreeNode<int> CreateTree()
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)
+      ->add_child(11)
+      ->add_child(111);
+    auto n2 = root.add_child(2);
+    n2->add_child(21);
+    root.add_child(3)
+      ->add_child(31)
+      ->add_child(311);
+    n2->add_child(22);
+
+    return root;
+  }
+
+  TEST(TreeNode, copyctor_structure)
+  {
+    auto const root = CreateTree();
+    auto const copied = root;
+
+    vector<int> vals_bfs, vals_dfs;
+    copy(copied.begin(), copied.end(), back_inserter(vals_bfs));
+    copy(copied.begin_dfs(), copied.end_dfs(), back_inserter(vals_dfs));
+
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 21, 22, 31, 111, 311 }), vals_bfs);
+    EXPECT_EQ(vector<int>({ 0, 1, 11, 111, 2, 21, 22, 3, 31, 311 }), vals_dfs);
+    EXPECT_EQ(10, copied.size());
+    EXPECT_EQ(3, copied.child_first()->next()->size());
+    EXPECT_EQ(4, copied.get_height());
+    EXPECT_EQ(4, copied.size_level(2));
+    EXPECT_EQ(&copied, copied.child_last()->parent());
+    EXPECT_EQ(311, copied.child_last_in_depth(3)->get());
+  }
+
+  TEST(TreeNode, copyctor_subnode)
+  {
+    auto const root = CreateTree();
+    TreeNode<int> copied = *root.child_last();
+
+    vector<int> vals;
+    copy(copied.begin(), copied.end(), back_inserter(vals));
+
+    EXPECT_EQ(vector<int>({ 3, 31, 311 }), vals);
+    EXPECT_EQ(nullptr, copied.parent());
+    EXPECT_EQ(2, copied.child_first()->child_first()->get_depth());
+  }
+
+  TEST(TreeNode, copyassignment)
+  {
+    auto const root = CreateTree();
+    TreeNode<int> copied(5);
+    copied.add_child(6);
+
+    copied = root;
+
+    vector<int> vals;
+    copy(copied.begin(), copied.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 21, 22, 31, 111, 311 }), vals);
+  }
+
+  TEST(TreeNode, copyctor_add_child_bfsOk)
+  {
+    auto const root = CreateTree();
+    auto copied = root;
+
+    copied.child_first()->add_child(12);
+    copied.child_first()->next()->child_first()->add_child(211);
+
+    vector<int> vals;
+    copy(copied.begin(), copied.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 12, 21, 22, 31, 111, 211, 311 }), vals);
+  }
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  TEST(TreeNode, copy_par)
+  {
+    TreeNode<int> root(0);
+    for (int i = 1; i <= 100; ++i)
+    {
+      auto child = root.add_child(i);
+      for (int j = 0; j < 100; ++j)
+        child->add_child(i * 1000 + j);
+    }
+
+    auto const copied = root.copy(std::execution::par);
+
+    vector<int> vals, vals_copied;
+    copy(root.begin_dfs(), root.end_dfs(), back_inserter(vals));
+    copy(copied.begin_dfs(), copied.end_dfs(), back_inserter(vals_copied));
+    EXPECT_EQ(vals, vals_copied);
+    EXPECT_EQ(root.size(), copied.size());
+    EXPECT_EQ(10000, copied.size_level(2));
+  }
+#endif
+}
+
+
+
+namespace TreeNodeBuildTests
+{
+  using namespace std;
+
+  TEST(TreeNode, build_parent_indices)
+  {
+    //                            0   1  2  3   4   5
+    vector<int> const parents = { 3, -1, 1, 1,  2,  3 };
+    vector<int> const values  = { 11, 0, 2, 1, 21, 12 };
+    // 0 - 2 - 21
+    //   - 1 - 11
+    //       - 12
+
+    auto const root = TreeNode<int>::build(parents.begin(), parents.end(), values.begin());
+
+    vector<int> vals_bfs, vals_dfs;
+    copy(root.begin(), root.end(), back_inserter(vals_bfs));
+    copy(root.begin_dfs(), root.end_dfs(), back_inserter(vals_dfs));
+
+    EXPECT_EQ(vector<int>({ 0, 2, 1, 21, 11, 12 }), vals_bfs);
+    EXPECT_EQ(vector<int>({ 0, 2, 21, 1, 11, 12 }), vals_dfs);
+    EXPECT_EQ(6, root.size());
+    EXPECT_EQ(3, root.child_last()->size());
+    EXPECT_EQ(3, root.size_level(2));
+    EXPECT_EQ(&root, root.child_first()->parent());
+    EXPECT_EQ(12, root.child_last_in_depth(2)->get());
+    EXPECT_EQ(2, root.child_last_in_depth(2)->get_depth());
+  }
+
+  TEST(TreeNode, build_invalid_parent_indices_throws)
+  {
+    using TN = TreeNode<int, TreeNodeAllocatorTests::CountingAllocator<int>>;
+    auto const n_before = TreeNodeAllocatorTests::allocated_node_num();
+    auto const build = [](vector<int> const& parents)
+    {
+      vector<int> const values(parents.size(), 1);
+      return TN::build(parents.begin(), parents.end(), values.begin());
+    };
+
+    EXPECT_THROW(build({}), invalid_argument);
+    EXPECT_THROW(build({ -1, 0, -1 }), invalid_argument); // multiple roots
+    EXPECT_THROW(build({ 1, 2, 0 }), invalid_argument); // no root
+    EXPECT_THROW(build({ -1, 1, 0 }), invalid_argument); // self-parent
+    EXPECT_THROW(build({ -1, 0, 3, 4, 2 }), invalid_argument); // cycle beside the tree
+    EXPECT_EQ(n_before, TreeNodeAllocatorTests::allocated_node_num()); // every node is freed
+
+    EXPECT_EQ(3, build({ 2, -1, 1 }).size());
+  }
+
+  TEST(TreeNode, build_rows)
+  {
+    vector<pair<int, string>> const rows = { { -1, "root" }, { 0, "a" }, { 0, "b" }, { 1, "aa" } };
+
+    auto root = TreeNode<string>::build(rows.begin(), rows.end());
+
+    vector<string> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<string>({ "root", "a", "b", "aa" }), vals);
+
+    root.child_last()->add_child("ba");
+    vals.clear();
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<string>({ "root", "a", "b", "aa", "ba" }), vals);
+  }
+
+  TEST(TreeNode, build_root_only)
+  {
+    vector<size_t> const parents = { size_t(-1) };
+    vector<int> const values = { 7 };
+
+    auto const root = TreeNode<int>::build(parents.begin(), parents.end(), values.begin());
+    EXPECT_EQ(1, root.size());
+    EXPECT_EQ(7, root.get());
+    EXPECT_EQ(nullptr, root.next_bfs());
+  }
+}
+
+
+
+namespace TreeNodeAddChildrenTests
+{
+  using namespace std;
+
+  TEST(TreeNode, add_children_root)
+  {
+    TreeNode<int> root(0);
+    vector<int> const values = { 1, 2, 3 };
+
+    auto const child = root.add_children(values.begin(), values.end());
+    EXPECT_EQ(1, child->get());
+    EXPECT_EQ(root.child_first(), child);
+    EXPECT_EQ(3, root.child_last()->get());
+    EXPECT_EQ(4, root.size());
+    EXPECT_EQ(3, root.size_level(1));
+
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3 }), vals);
+    EXPECT_EQ(nullptr, root.add_children(values.end(), values.end()));
+    EXPECT_EQ(4, root.size());
+  }
+
+  TEST(TreeNode, add_children_bfs_splice)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    auto n3 = root.add_child(3);
+    n1->add_child(11);
+    n3->add_child(31);
+
+    vector<int> const values = { 21, 22, 23 };
+    n2->add_children(values.begin(), values.end());
+    vector<int> const values_more = { 12, 13 };
+    n1->add_children(values_more.begin(), values_more.end());
+
+    vector<int> vals_bfs, vals_dfs;
+    copy(root.begin(), root.end(), back_inserter(vals_bfs));
+    copy(root.begin_dfs(), root.end_dfs(), back_inserter(vals_dfs));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 12, 13, 21, 22, 23, 31 }), vals_bfs);
+    EXPECT_EQ(vector<int>({ 0, 1, 11, 12, 13, 2, 21, 22, 23, 3, 31 }), vals_dfs);
+    EXPECT_EQ(11, root.size());
+    EXPECT_EQ(4, n2->size());
+    EXPECT_EQ(7, root.size_level(2));
+    EXPECT_EQ(23, n2->child_last()->get());
+    EXPECT_EQ(2, n2->child_first()->get_depth());
+    EXPECT_EQ(31, root.child_last_in_depth(2)->get());
+
+    // The spliced nodes are parents in the right order as well
+    n2->child_first()->add_child(211);
+    n1->child_last()->add_child(131);
+    vals_bfs.clear();
+    copy(root.begin_bfs(3), root.end_bfs(3), back_inserter(vals_bfs));
+    EXPECT_EQ(vector<int>({ 131, 211 }), vals_bfs);
+  }
+
+  TEST(TreeNode, add_children_label_exhaustion)
+  {
+    TreeNode<int> root(0);
+    vector<TreeNode<int>*> parents;
+    for (int i = 0; i < 100; ++i)
+      parents.push_back(root.add_child(i));
+
+    root.add_child(100)->add_child(10000);
+
+    // Every run is spliced before the previous one, so the label gap runs out
+    for (int i = 99; i >= 0; --i)
+    {
+      vector<int> const values(100, i * 100);
+      parents[i]->add_children(values.begin(), values.end());
+    }
+
+    EXPECT_EQ(10001, root.size_level(2));
+    EXPECT_EQ(10000, root.child_last_in_depth(2)->get());
+    EXPECT_EQ(10103, root.size());
+
+    size_t n = 0;
+    for (auto p = root.child_begin_in_depth(2); p; p = p->next_bfs(), ++n)
+      EXPECT_EQ(n / 100 * 100, p->get());
+
+    EXPECT_EQ(10001, n);
+
+    // Insertion by the relabeled nodes
+    parents[50]->child_last()->add_child(1);
+    parents[20]->child_first()->add_child(0);
+    parents[80]->child_first()->add_child(2);
+    vector<int> vals;
+    copy(root.begin_bfs(3), root.end_bfs(3), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2 }), vals);
+  }
+
+  TEST(TreeNode, emplace_children)
+  {
+    // Explicit constructor of the data: vector(size_t)
+    TreeNode<vector<int>> root;
+    vector<size_t> const sizes = { 1, 2, 3 };
+
+    auto const child = root.emplace_children(sizes.begin(), sizes.end());
+    EXPECT_EQ(1, child->get().size());
+    EXPECT_EQ(3, root.child_last()->get().size());
+    EXPECT_EQ(4, root.size());
+
+    vector<string> const names = { "x", "yy" };
+    TreeNode<string> root_str("root");
+    root_str.emplace_children(names.begin(), names.end());
+    EXPECT_EQ(2, root_str.size_segment());
+    EXPECT_EQ("yy", root_str.child_last()->get());
+  }
+
+  TEST(TreeNode, initializer_list)
+  {
+    TreeNode<int> root = { 0, 1, 2, 3 };
+    EXPECT_EQ(4, root.size());
+    EXPECT_EQ(3, root.child_last()->get());
+    EXPECT_EQ(1, root.child_first()->get_depth());
+  }
+}
+
+
+
+namespace TreeNodeTeardownTests
+{
+  using namespace std;
+  using TreeNodeAllocatorTests::CountingAllocator;
+  using TreeNodeAllocatorTests::allocated_node_num;
+
+  TEST(TreeNode, teardown_deep_chain)
+  {
+    using TN = TreeNode<int, CountingAllocator<int>>;
+    vector<int> parents(100000), values(100000);
+    for (int i = 0; i < 100000; ++i)
+    {
+      parents[i] = i - 1;
+      values[i] = i;
+    }
+
+    auto const n_before = allocated_node_num();
+    {
+      auto const root = TN::build(parents.begin(), parents.end(), values.begin());
+      EXPECT_EQ(100000 - 1, allocated_node_num() - n_before);
+    }
+    EXPECT_EQ(n_before, allocated_node_num());
+
+    auto root = TN::build(parents.begin(), parents.end(), values.begin());
+    root.child_first()->child_first()->remove();
+    EXPECT_EQ(2, root.size());
+    EXPECT_EQ(2, root.get_height());
+    EXPECT_EQ(1, allocated_node_num() - n_before);
+
+    root.clear();
+    EXPECT_EQ(n_before, allocated_node_num());
+  }
+
+  TEST(TreeNode, teardown_wide)
+  {
+    auto const n_before = allocated_node_num();
+    {
+      TreeNode<int, CountingAllocator<int>> root(0);
+      vector<int> const values(200000, 1);
+      root.add_child(1)->add_children(values.begin(), values.end());
+      root.add_child(2)->add_child(3);
+      EXPECT_EQ(200004, root.size());
+
+      root.child_first()->clear();
+      EXPECT_EQ(4, root.size());
+      EXPECT_EQ(1, root.size_level(2));
+      EXPECT_EQ(3, root.child_begin_in_depth(2)->get());
+      EXPECT_EQ(3, allocated_node_num() - n_before);
+
+      root.child_first()->add_children(values.begin(), values.end());
+    }
+    EXPECT_EQ(n_before, allocated_node_num());
+  }
+
+  TEST(TreeNode, clear_middle_subtree)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    auto n3 = root.add_child(3);
+    n1->add_child(11)->add_child(111)->add_child(1111);
+    auto n21 = n2->add_child(21);
+    n21->add_child(211)->add_child(2111);
+    n21->add_child(212);
+    n2->add_child(22)->add_child(221);
+    n3->add_child(31)->add_child(311)->add_child(3111);
+
+    n2->clear();
+
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 31, 111, 311, 1111, 3111 }), vals);
+    EXPECT_EQ(10, root.size());
+    EXPECT_EQ(2, root.size_level(2));
+    EXPECT_EQ(2, root.size_level(4));
+    EXPECT_EQ(5, root.get_height());
+
+    // The level index knows that n2 and its former descendants are not parents anymore
+    n2->add_child(23)->add_child(231);
+    vals.clear();
+    copy(root.begin_bfs(2), root.end_bfs(3), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 11, 23, 31, 111, 231, 311 }), vals);
+
+    n3->remove();
+    n1->remove();
+    vals.clear();
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 2, 23, 231 }), vals);
+    EXPECT_EQ(4, root.get_height());
+  }
+}
+
+
+
+namespace TreeNodeReclamationTests
+{
+  using namespace std;
+  using TreeNodeAllocatorTests::CountingAllocator;
+  using TreeNodeAllocatorTests::allocated_node_num;
+
+  using TN = TreeNode<int, CountingAllocator<int>>;
+
+  // The mode is a per-type setting, it is restored at the end of every test
+  struct DeferredReclamation
+  {
+    DeferredReclamation() { TN::set_reclamation(TN::Reclamation::deferred); }
+    ~DeferredReclamation() { TN::set_reclamation(TN::Reclamation::immediate); TN::reclaim(); }
+  };
+
+  TEST(TreeNode, reclamation_default_immediate)
+  {
+    EXPECT_EQ(TN::Reclamation::immediate, TN::get_reclamation());
+
+    auto const n_before = allocated_node_num();
+    TN root(0);
+    root.add_child(1)->add_child(11);
+    root.child_first()->remove();
+    EXPECT_EQ(0, TN::size_deferred());
+    EXPECT_EQ(n_before, allocated_node_num());
+  }
+
+  TEST(TreeNode, reclamation_deferred_remove)
+  {
+    DeferredReclamation const deferred;
+    auto const n_before = allocated_node_num();
+
+    TN root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    n1->add_child(11)->add_child(111);
+    n2->add_child(21);
+
+    n1->remove();
+    EXPECT_EQ(3, root.size());
+    EXPECT_EQ(3, root.get_height());
+    EXPECT_EQ(3, TN::size_deferred());
+    EXPECT_EQ(5, allocated_node_num() - n_before);
+
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 2, 21 }), vals);
+
+    EXPECT_EQ(3, TN::reclaim());
+    EXPECT_EQ(0, TN::size_deferred());
+    EXPECT_EQ(2, allocated_node_num() - n_before);
+    EXPECT_EQ(0, TN::reclaim());
+  }
+
+  TEST(TreeNode, reclamation_deferred_clear)
+  {
+    DeferredReclamation const deferred;
+    auto const n_before = allocated_node_num();
+    {
+      TN root(0);
+      vector<int> const values(1000, 1);
+      root.add_child(1)->add_children(values.begin(), values.end());
+      root.add_child(2)->add_children(values.begin(), values.end());
+
+      root.child_first()->clear();
+      EXPECT_EQ(1003, root.size());
+      EXPECT_EQ(1000, root.size_level(2));
+      EXPECT_EQ(1000, TN::size_deferred());
+
+      root.clear();
+      EXPECT_EQ(1, root.size());
+      EXPECT_EQ(2002, TN::size_deferred());
+      EXPECT_EQ(2002, allocated_node_num() - n_before);
+    }
+
+    // The destroyed tree and the reclaimer thread are independent
+    size_t n = 0;
+    thread reclaimer([&n] { n = TN::reclaim(); });
+    reclaimer.join();
+    EXPECT_EQ(2002, n);
+    EXPECT_EQ(n_before, allocated_node_num());
+  }
+
+  // Own node type of the pooled allocator, so its pool and its reclaimer are first used by the death test
+  struct QueuedAtExit
+  {
+    int id = 0;
+    char payload[200] = {};
+    vector<int> values;
+  };
+
+  TEST(TreeNode, reclamation_deferred_queued_at_exit)
+  {
+    using TNP = TreeNode<QueuedAtExit>;
+
+    GTEST_FLAG_SET(death_test_style, "threadsafe");
+    EXPECT_EXIT(
+      {
+        TNP::set_reclamation(TNP::Reclamation::deferred);
+        static TNP root;
+        for (int i = 0; i < 100; ++i)
+          root.add_child(QueuedAtExit{ i, {}, vector<int>(10, i) })->add_child(QueuedAtExit{});
+
+        root.child_first()->remove();
+        root.clear();
+        if (TNP::size_deferred() != 200)
+          exit(1);
+
+        exit(0); // the queued nodes are destroyed by the static destructors
+      },
+      ::testing::ExitedWithCode(0), "");
+  }
+}
+
+
+
+namespace TreeNodeMoveTests
+{
+  using namespace std;
+
+  template<typename TNode>
+  vector<int> values_bfs(TNode const& root)
+  {
+    vector<int> vals;
+    copy(root.begin(), root.end(), back_inserter(vals));
+    return vals;
+  }
+
+  template<typename TNode>
+  vector<int> values_dfs(TNode const& root)
+  {
+    vector<int> vals;
+    copy(root.begin_dfs(), root.end_dfs(), back_inserter(vals));
+    return vals;
+  }
+
+  TEST(TreeNode, move_to_other_parent_same_depth)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    auto n11 = n1->add_child(11);
+    n11->add_child(111);
+    n1->add_child(12);
+    n2->add_child(21)->add_child(211);
+
+    n11->move_to(n2);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 12, 21, 11, 211, 111 }), values_bfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 12, 2, 21, 211, 11, 111 }), values_dfs(root));
+    EXPECT_EQ(2, n1->size());
+    EXPECT_EQ(5, n2->size());
+    EXPECT_EQ(8, root.size());
+    EXPECT_EQ(n2, n11->parent());
+    EXPECT_EQ(n11, n2->child_last());
+    EXPECT_EQ(111, root.child_last_in_depth(3)->get());
+  }
+
+  TEST(TreeNode, move_to_deeper_and_back)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    n1->add_child(11)->add_child(111);
+    auto n3 = n2->add_child(21)->add_child(211);
+
+    // The levels of the moved subtree are shifted below the current height
+    n1->move_to(n3);
+    EXPECT_EQ(vector<int>({ 0, 2, 21, 211, 1, 11, 111 }), values_bfs(root));
+    EXPECT_EQ(6, root.child_last_in_depth(6)->get_depth());
+    EXPECT_EQ(7, root.get_height());
+    EXPECT_EQ(1, root.size_level(1));
+    EXPECT_EQ(4, n1->get_depth());
+
+    n1->move_before(n2);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 11, 21, 111, 211 }), values_bfs(root));
+    EXPECT_EQ(4, root.get_height());
+    EXPECT_EQ(2, root.size_level(3));
+    EXPECT_EQ(1, n1->get_depth());
+    EXPECT_EQ(3, n1->child_first()->child_first()->get_depth());
+  }
+
+  TEST(TreeNode, move_before_after_siblings)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    auto n3 = root.add_child(3);
+    n1->add_child(11);
+    n3->add_child(31);
+
+    n3->move_before(n1);
+    EXPECT_EQ(vector<int>({ 0, 3, 1, 2, 31, 11 }), values_bfs(root));
+    EXPECT_EQ(n3, root.child_first());
+    EXPECT_EQ(n2, root.child_last());
+
+    n3->move_after(n2);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 31 }), values_bfs(root));
+    EXPECT_EQ(n3, root.child_last());
+    EXPECT_EQ(n2, n3->prev());
+
+    // No-ops
+    n3->move_after(n2);
+    n2->move_before(n3);
+    n3->move_to(&root);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 31 }), values_bfs(root));
+
+    // The splice into the gap of an empty parent in the middle of the level
+    n1->child_first()->move_to(n2);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 31 }), values_bfs(root));
+    EXPECT_EQ(nullptr, n1->child_first());
+    n2->add_child(22);
+    n1->add_child(12);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 12, 11, 22, 31 }), values_bfs(root));
+  }
+
+  TEST(TreeNode, move_to_other_tree)
+  {
+    TreeNode<int> root1(0);
+    auto n1 = root1.add_child(1);
+    n1->add_child(11)->add_child(111);
+    root1.add_child(2);
+
+    TreeNode<int> root2(100);
+    auto n101 = root2.add_child(101);
+
+    n1->move_to(n101);
+    EXPECT_EQ(vector<int>({ 0, 2 }), values_bfs(root1));
+    EXPECT_EQ(2, root1.size());
+    EXPECT_EQ(2, root1.get_height());
+    EXPECT_EQ(vector<int>({ 100, 101, 1, 11, 111 }), values_bfs(root2));
+    EXPECT_EQ(5, root2.size());
+    EXPECT_EQ(5, root2.get_height());
+    EXPECT_EQ(&root2, n1->parent()->parent());
+  }
+}
+
+
+
+namespace TreeNodeDetachGraftTests
+{
+  using namespace std;
+  using TreeNodeMoveTests::values_bfs;
+  using TreeNodeMoveTests::values_dfs;
+
+  TEST(TreeNode, detach)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    auto n3 = root.add_child(3);
+    n1->add_child(11)->add_child(111);
+    auto n21 = n2->add_child(21);
+    n21->add_child(211);
+    n2->add_child(22)->add_child(221);
+    n3->add_child(31)->add_child(311);
+
+    auto const n211 = n21->child_first();
+    auto part = n2->detach();
+
+    EXPECT_EQ(vector<int>({ 0, 1, 3, 11, 31, 111, 311 }), values_bfs(root));
+    EXPECT_EQ(7, root.size());
+    EXPECT_EQ(2, root.size_level(2));
+
+    EXPECT_EQ(vector<int>({ 2, 21, 22, 211, 221 }), values_bfs(part));
+    EXPECT_EQ(vector<int>({ 2, 21, 211, 22, 221 }), values_dfs(part));
+    EXPECT_EQ(5, part.size());
+    EXPECT_EQ(3, part.get_height());
+    EXPECT_EQ(2, part.size_level(2));
+    EXPECT_EQ(nullptr, part.parent());
+    EXPECT_EQ(&part, n21->parent());
+    EXPECT_EQ(2, n211->get_depth());
+    EXPECT_EQ(n211, part.child_begin_in_depth(2));
+
+    // Both trees stay consistent
+    n211->add_child(2111);
+    n1->child_first()->add_child(112);
+    n3->add_child(32);
+    EXPECT_EQ(vector<int>({ 2, 21, 22, 211, 221, 2111 }), values_bfs(part));
+    EXPECT_EQ(vector<int>({ 0, 1, 3, 11, 31, 32, 111, 112, 311 }), values_bfs(root));
+  }
+
+  TEST(TreeNode, detach_leaf)
+  {
+    TreeNode<int> root(0);
+    root.add_child(1)->add_child(11);
+
+    auto leaf = root.child_first()->child_first()->detach();
+    EXPECT_EQ(11, leaf.get());
+    EXPECT_EQ(1, leaf.size());
+    EXPECT_EQ(1, leaf.get_height());
+    EXPECT_EQ(2, root.get_height());
+    EXPECT_EQ(vector<int>({ 0, 1 }), values_bfs(root));
+  }
+
+  TEST(TreeNode, graft)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    n1->add_child(11);
+    n2->add_child(21)->add_child(211);
+
+    TreeNode<int> other(100);
+    other.add_child(101)->add_child(1011);
+    other.add_child(102);
+
+    auto const node = n1->graft(std::move(other));
+    EXPECT_EQ(100, node->get());
+    EXPECT_EQ(n1, node->parent());
+    EXPECT_EQ(2, node->get_depth());
+    EXPECT_EQ(1, other.size());
+    EXPECT_EQ(nullptr, other.child_first());
+    EXPECT_EQ(nullptr, other.next_bfs());
+
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 11, 100, 21, 101, 102, 211, 1011 }), values_bfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 11, 100, 101, 1011, 102, 2, 21, 211 }), values_dfs(root));
+    EXPECT_EQ(10, root.size());
+    EXPECT_EQ(6, n1->size());
+    EXPECT_EQ(5, root.get_height());
+    EXPECT_EQ(4, root.child_last_in_depth(4)->get_depth());
+
+    // The grafted tree can be detached again
+    auto back = node->detach();
+    EXPECT_EQ(vector<int>({ 100, 101, 102, 1011 }), values_bfs(back));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 11, 21, 211 }), values_bfs(root));
+    EXPECT_EQ(4, root.get_height());
+  }
+
+  TEST(TreeNode, graft_root_only)
+  {
+    TreeNode<int> root(0);
+    root.graft(TreeNode<int>(1));
+    root.graft(TreeNode<int>{ 2, 21, 22 });
+
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 21, 22 }), values_bfs(root));
+    EXPECT_EQ(5, root.size());
+    EXPECT_EQ(2, root.size_level(2));
+  }
+}
+
+
+
+namespace TreeNodeInsertTests
+{
+  using namespace std;
+  using TreeNodeMoveTests::values_bfs;
+
+  struct Payload
+  {
+    static int& copy_num() { static int n = 0; return n; }
+
+    int id = 0;
+    string name;
+
+    Payload() = default;
+    Payload(int id, string name) : id(id), name(std::move(name)) {}
+    Payload(Payload const& r) : id(r.id), name(r.name) { ++copy_num(); }
+    Payload(Payload&&) = default;
+    Payload& operator=(Payload const& r) { id = r.id; name = r.name; ++copy_num(); return *this; }
+    Payload& operator=(Payload&&) = default;
+  };
+
+  TEST(TreeNode, add_child_rvalue_is_not_copied)
+  {
+    TreeNode<Payload> root;
+    auto const copy_num = Payload::copy_num();
+
+    root.add_child(Payload(1, "a"));
+    auto const child = root.emplace_child(2, "b");
+    EXPECT_EQ(copy_num, Payload::copy_num());
+    EXPECT_EQ(2, child->get().id);
+    EXPECT_EQ("b", child->get().name);
+    EXPECT_EQ(3, root.size());
+  }
+
+  TEST(TreeNode, push_front_child)
+  {
+    TreeNode<int> root(0);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    n1->add_child(11);
+    n2->add_child(21);
+
+    root.push_front_child(-1)->add_child(-11);
+    n2->push_front_child(20);
+
+    EXPECT_EQ(vector<int>({ 0, -1, 1, 2, -11, 11, 20, 21 }), values_bfs(root));
+    EXPECT_EQ(-1, root.child_first()->get());
+    EXPECT_EQ(nullptr, root.child_first()->prev());
+    EXPECT_EQ(n1, root.child_first()->next());
+    EXPECT_EQ(8, root.size());
+    EXPECT_EQ(-11, root.child_begin_in_depth(2)->get());
+  }
+
+  TEST(TreeNode, insert_child_at)
+  {
+    TreeNode<int> root(0);
+    root.insert_child_at(0, 2);
+    root.insert_child_at(0, 0);
+    root.insert_child_at(1, 1);
+    root.insert_child_at(3, 4);
+    root.insert_child_at(next(root.begin_segment(), 3), 3);
+    root.insert_child_at(root.end_segment<TreeNode<int>*>(), 5);
+
+    vector<int> vals;
+    copy(root.begin_segment(), root.end_segment(), back_inserter(vals));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 4, 5 }), vals);
+    EXPECT_EQ(5, root.child_last()->get());
+    EXPECT_EQ(7, root.size());
+
+    // Middle children get their first children between the children of their siblings
+    root.child_first()->add_child(10);
+    root.child_last()->add_child(50);
+    root.child_first()->next()->next()->insert_child_at(0, 20);
+    EXPECT_EQ(vector<int>({ 0, 0, 1, 2, 3, 4, 5, 10, 20, 50 }), values_bfs(root));
+  }
+
+  TEST(TreeNode, insert_before_after)
+  {
+    TreeNode<int> root(0);
+    auto n2 = root.add_child(2);
+    n2->insert_before(1);
+    n2->insert_after(3)->insert_after(4);
+    n2->add_child(21);
+    n2->child_first()->insert_before(20);
+    n2->child_first()->insert_after(205);
+
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 4, 20, 205, 21 }), values_bfs(root));
+    EXPECT_EQ(4, n2->size());
+    EXPECT_EQ(21, n2->child_last()->get());
+    EXPECT_EQ(4, root.child_last()->get());
+    EXPECT_EQ(3, root.size_level(2));
+  }
+}
+
+
+
+namespace TreeNodeSortTests
+{
+  using namespace std;
+  using TreeNodeMoveTests::values_bfs;
+  using TreeNodeMoveTests::values_dfs;
+
+  TreeNode<int> make_tree()
+  {
+    TreeNode<int> root(0);
+    auto n3 = root.add_child(3);
+    auto n1 = root.add_child(1);
+    auto n2 = root.add_child(2);
+    n3->add_child(32)->add_child(321);
+    n3->add_child(31);
+    n1->add_child(12);
+    n1->add_child(11)->add_child(111);
+    n2->add_child(21);
+    return root;
+  }
+
+  TEST(TreeNode, sort_children_relinks_subtrees)
+  {
+    auto root = make_tree();
+    auto const n3 = root.child_first();
+    root.sort_children();
+
+    EXPECT_EQ(vector<int>({ 0, 1, 12, 11, 111, 2, 21, 3, 32, 321, 31 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 12, 11, 21, 32, 31, 111, 321 }), values_bfs(root));
+    EXPECT_EQ(n3, root.child_last());
+    EXPECT_EQ(nullptr, root.child_first()->prev());
+    EXPECT_EQ(nullptr, n3->next());
+    EXPECT_EQ(12, root.child_begin_in_depth(2)->get());
+    EXPECT_EQ(31, root.child_last_in_depth(2)->get());
+    EXPECT_EQ(321, root.child_last_in_depth(3)->get());
+    EXPECT_EQ(11, root.size());
+
+    // Adding after the sort uses the relinked level index
+    n3->child_last()->add_child(311);
+    root.child_first()->child_first()->add_child(121);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 12, 11, 21, 32, 31, 121, 111, 321, 311 }), values_bfs(root));
+  }
+
+  TEST(TreeNode, sort_children_of_inner_node)
+  {
+    auto root = make_tree();
+    auto const n3 = root.child_first();
+    n3->sort_children(greater<int>());
+    EXPECT_EQ(vector<int>({ 0, 3, 1, 2, 32, 31, 12, 11, 21, 321, 111 }), values_bfs(root));
+
+    n3->sort_children();
+    EXPECT_EQ(vector<int>({ 0, 3, 1, 2, 31, 32, 12, 11, 21, 321, 111 }), values_bfs(root));
+    EXPECT_EQ(vector<int>({ 0, 3, 31, 32, 321, 1, 12, 11, 111, 2, 21 }), values_dfs(root));
+  }
+
+  TEST(TreeNode, sort_children_is_stable)
+  {
+    TreeNode<pair<int, int>> root;
+    for (int i = 0; i < 6; ++i)
+      root.add_child({ i % 2, i });
+
+    root.sort_children([](auto const& l, auto const& r) { return l.first < r.first; });
+    vector<int> seconds;
+    for (auto it = root.begin_segment(); it != root.end_segment(); ++it)
+      seconds.push_back(it->second);
+
+    EXPECT_EQ(vector<int>({ 0, 2, 4, 1, 3, 5 }), seconds);
+  }
+
+  TEST(TreeNode, sort_all_segments)
+  {
+    auto root = make_tree();
+    root.sort_all_segments();
+    EXPECT_EQ(vector<int>({ 0, 1, 11, 111, 12, 2, 21, 3, 31, 32, 321 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 12, 21, 31, 32, 111, 321 }), values_bfs(root));
+
+    auto sub = root.child_last();
+    sub->sort_all_segments(greater<int>());
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 11, 12, 21, 32, 31, 111, 321 }), values_bfs(root));
+  }
+
+#if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+  TEST(TreeNode, sort_all_segments_par)
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < 5000; ++i)
+    {
+      parents.push_back(((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>((i * 40503u) % 1000));
+    }
+
+    auto root = TreeNode<int>::build(parents.begin(), parents.end(), values.begin());
+    auto expected = root;
+    expected.sort_all_segments(greater<int>());
+    root.sort_all_segments(std::execution::par, greater<int>());
+
+    EXPECT_EQ(values_bfs(expected), values_bfs(root));
+    EXPECT_EQ(values_dfs(expected), values_dfs(root));
+    for (auto it = root.begin_bfs<TreeNode<int>*>(); it != root.end_bfs<TreeNode<int>*>(); ++it)
+    {
+      vector<int> segment((*it)->begin_segment(), (*it)->end_segment());
+      EXPECT_TRUE(is_sorted(segment.begin(), segment.end(), greater<int>()));
+    }
+  }
+#endif
+}
+
+
+
+namespace TreeNodeKeyIndexTests
+{
+  using namespace std;
+
+  struct Entry
+  {
+    string name;
+    int value = 0;
+  };
+
+  struct NameOf
+  {
+    string const& operator()(Entry const& entry) const noexcept { return entry.name; }
+  };
+
+  using DirTree = TreeNode<Entry, TreeNodePoolAllocator<Entry>, NameOf>;
+
+  DirTree make_tree()
+  {
+    DirTree root(Entry{ "", 0 });
+    auto usr = root.add_child({ "usr", 1 });
+    auto bin = usr->add_child({ "bin", 2 });
+    bin->add_child({ "ls", 3 });
+    bin->add_child({ "cat", 4 });
+    usr->add_child({ "lib", 5 });
+    root.add_child({ "etc", 6 })->add_child({ "hosts", 7 });
+    return root;
+  }
+
+  TEST(TreeNode, find_child)
+  {
+    auto root = make_tree();
+    auto const usr = root.find_child("usr");
+    ASSERT_NE(nullptr, usr);
+    EXPECT_EQ(1, usr->get().value);
+    EXPECT_EQ(5, usr->find_child("lib")->get().value);
+    EXPECT_EQ(nullptr, usr->find_child("etc"));
+    EXPECT_EQ(nullptr, usr->find_child("lib")->find_child("x"));
+
+    auto const& root_const = root;
+    EXPECT_EQ(usr, root_const.find_child("usr"));
+  }
+
+  // Invalid name: the key (and so the index entry) cannot be made
+  struct CheckedNameOf
+  {
+    string const& operator()(Entry const& entry) const
+    {
+      if (entry.name == "!")
+        throw invalid_argument("invalid name");
+
+      return entry.name;
+    }
+  };
+
+  TEST(TreeNode, add_child_key_throws_tree_unchanged)
+  {
+    using CheckedTree = TreeNode<Entry, TreeNodePoolAllocator<Entry>, CheckedNameOf>;
+    CheckedTree root(Entry{ "", 0 });
+    auto const usr = root.add_child({ "usr", 1 });
+    auto const etc = root.add_child({ "etc", 2 });
+    etc->add_child({ "hosts", 3 });
+
+    EXPECT_THROW(root.add_child({ "!", 4 }), invalid_argument);
+    EXPECT_THROW(usr->add_child({ "!", 5 }), invalid_argument); // usr would be a new parent
+    vector<Entry> const entries = { { "bin", 6 }, { "!", 7 } };
+    EXPECT_THROW(usr->add_children(entries.begin(), entries.end()), invalid_argument);
+
+    EXPECT_EQ(4, root.size());
+    EXPECT_EQ(3, root.get_height());
+    EXPECT_EQ(nullptr, usr->child_first());
+    EXPECT_EQ(nullptr, usr->find_child("bin"));
+
+    usr->add_child({ "lib", 8 });
+    vector<int> values;
+    for (auto const& entry : root)
+      values.push_back(entry.value);
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 8, 3 }), values);
+    EXPECT_EQ(8, usr->find_child("lib")->get().value);
+  }
+
+  // The keys are copies, they cannot be made while is_failing is set (e.g. out of memory)
+  struct FallibleNameOf
+  {
+    static bool is_failing;
+
+    string operator()(Entry const& entry) const
+    {
+      if (is_failing)
+        throw bad_alloc();
+
+      return entry.name;
+    }
+  };
+
+  bool FallibleNameOf::is_failing = false;
+
+  using FallibleTree = TreeNode<Entry, TreeNodePoolAllocator<Entry>, FallibleNameOf>;
+
+  FallibleTree make_fallible_tree()
+  {
+    FallibleTree root(Entry{ "", 0 });
+    auto usr = root.add_child({ "usr", 1 });
+    auto bin = usr->add_child({ "bin", 2 });
+    bin->add_child({ "ls", 3 });
+    bin->add_child({ "cat", 4 });
+    usr->add_child({ "lib", 5 });
+    root.add_child({ "etc", 6 })->add_child({ "hosts", 7 });
+    return root;
+  }
+
+  vector<int> values_dfs(FallibleTree const& root)
+  {
+    vector<int> values;
+    for (auto it = root.begin_dfs(); it != root.end_dfs(); ++it)
+      values.push_back(it->value);
+    return values;
+  }
+
+  vector<int> values_bfs(FallibleTree const& root)
+  {
+    vector<int> values;
+    for (auto it = root.begin_bfs(); it != root.end_bfs(); ++it)
+      values.push_back(it->value);
+    return values;
+  }
+
+  TEST(TreeNode, move_key_throws_tree_unchanged)
+  {
+    auto root = make_fallible_tree();
+    auto const usr = root.find_child("usr");
+    auto const bin = usr->find_child("bin");
+    auto const lib = usr->find_child("lib");
+    auto const etc = root.find_child("etc");
+
+    FallibleNameOf::is_failing = true;
+    EXPECT_THROW(bin->move_to(etc), bad_alloc);
+    EXPECT_THROW(bin->move_to(etc->child_first()), bad_alloc); // hosts would be a new parent
+    EXPECT_THROW(bin->move_after(lib), bad_alloc);
+    EXPECT_THROW(lib->move_before(bin), bad_alloc);
+    FallibleNameOf::is_failing = false;
+
+    EXPECT_EQ(8, root.size());
+    EXPECT_EQ(5, usr->size());
+    EXPECT_EQ(2, etc->size());
+    EXPECT_EQ(4, root.get_height());
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 6, 2, 5, 7, 3, 4 }), values_bfs(root));
+    EXPECT_EQ(bin, usr->find_child("bin"));
+    EXPECT_EQ(nullptr, etc->find_child("bin"));
+
+    bin->move_to(etc);
+    EXPECT_EQ(vector<int>({ 0, 1, 5, 6, 7, 2, 3, 4 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 6, 5, 7, 2, 3, 4 }), values_bfs(root));
+    EXPECT_EQ(nullptr, usr->find_child("bin"));
+    EXPECT_EQ(bin, etc->find_child("bin"));
+  }
+
+  TEST(TreeNode, graft_key_throws_trees_unchanged)
+  {
+    auto root = make_fallible_tree();
+    auto const usr = root.find_child("usr");
+    auto const lib = usr->find_child("lib");
+
+    FallibleTree other(Entry{ "opt", 8 });
+    other.add_child({ "share", 9 })->add_child({ "man", 10 });
+
+    FallibleNameOf::is_failing = true;
+    EXPECT_THROW(usr->graft(std::move(other)), bad_alloc);
+    EXPECT_THROW(lib->graft(std::move(other)), bad_alloc); // lib would be a new parent
+    FallibleNameOf::is_failing = false;
+
+    EXPECT_EQ(8, root.size());
+    EXPECT_EQ(4, root.get_height());
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 6, 2, 5, 7, 3, 4 }), values_bfs(root));
+    EXPECT_EQ(nullptr, usr->find_child("opt"));
+    EXPECT_EQ(3, other.size());
+    EXPECT_EQ("opt", other.get().name);
+    EXPECT_EQ(vector<int>({ 8, 9, 10 }), values_dfs(other));
+
+    auto const opt = lib->graft(std::move(other));
+    EXPECT_EQ(11, root.size());
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 3, 4, 5, 8, 9, 10, 6, 7 }), values_dfs(root));
+    EXPECT_EQ(vector<int>({ 0, 1, 6, 2, 5, 7, 3, 4, 8, 9, 10 }), values_bfs(root));
+    EXPECT_EQ(opt, lib->find_child("opt"));
+  }
+
+  TEST(TreeNode, key_erase_without_key_of)
+  {
+    auto root = make_fallible_tree();
+    auto const usr = root.find_child("usr");
+    auto const bin = usr->find_child("bin");
+    auto const etc = root.find_child("etc");
+
+    FallibleNameOf::is_failing = true;
+    bin->find_child("ls")->remove();
+    etc->clear();
+    auto const lib = usr->find_child("lib")->detach();
+    FallibleNameOf::is_failing = false;
+
+    EXPECT_EQ(5, lib.get().value);
+    EXPECT_EQ(5, root.size());
+    EXPECT_EQ(vector<int>({ 0, 1, 2, 4, 6 }), values_dfs(root));
+    EXPECT_EQ(nullptr, bin->find_child("ls"));
+    EXPECT_EQ(4, bin->find_child("cat")->get().value);
+    EXPECT_EQ(nullptr, usr->find_child("lib"));
+    EXPECT_EQ(nullptr, etc->find_child("hosts"));
+
+    bin->add_child({ "ls", 8 });
+    usr->add_child({ "lib", 9 });
+    EXPECT_EQ(8, root.resolve(vector<string>{ "usr", "bin", "ls" })->get().value);
+    EXPECT_EQ(9, usr->find_child("lib")->get().value);
+  }
+
+  TEST(TreeNode, resolve)
+  {
+    auto root = make_tree();
+    EXPECT_EQ(3, root.resolve(vector<string>{ "usr", "bin", "ls" })->get().value);
+    EXPECT_EQ(7, root.resolve(vector<string>{ "etc", "hosts" })->get().value);
+    EXPECT_EQ(nullptr, root.resolve(vector<string>{ "usr", "sbin", "ls" }));
+    EXPECT_EQ(&root, root.resolve(vector<string>{}));
+
+    string const path[] = { "usr", "bin" };
+    EXPECT_EQ(2, root.resolve(begin(path), end(path))->get().value);
+  }
+
+  TEST(TreeNode, key_index_follows_mutations)
+  {
+    auto root = make_tree();
+    auto usr = root.find_child("usr");
+    auto bin = usr->find_child("bin");
+
+    bin->find_child("ls")->remove();
+    EXPECT_EQ(nullptr, bin->find_child("ls"));
+    EXPECT_NE(nullptr, bin->find_child("cat"));
+
+    bin->push_front_child({ "sh", 8 });
+    bin->find_child("cat")->insert_after({ "cp", 9 });
+    EXPECT_EQ(9, root.resolve(vector<string>{ "usr", "bin", "cp" })->get().value);
+    EXPECT_EQ(8, root.resolve(vector<string>{ "usr", "bin", "sh" })->get().value);
+
+    bin->move_to(root.find_child("etc"));
+    EXPECT_EQ(nullptr, usr->find_child("bin"));
+    EXPECT_EQ(bin, root.resolve(vector<string>{ "etc", "bin" }));
+
+    auto part = root.find_child("etc")->detach();
+    EXPECT_EQ(nullptr, root.find_child("etc"));
+    EXPECT_EQ(9, part.resolve(vector<string>{ "bin", "cp" })->get().value);
+
+    auto grafted = usr->graft(std::move(part));
+    EXPECT_EQ(grafted, usr->find_child("etc"));
+    EXPECT_EQ(4, root.resolve(vector<string>{ "usr", "etc", "bin", "cat" })->get().value);
+
+    DirTree::swap(usr->find_child("lib"), grafted);
+    EXPECT_EQ(5, usr->find_child("lib")->get().value);
+    EXPECT_EQ(6, usr->find_child("etc")->get().value);
+
+    usr->clear();
+    EXPECT_EQ(nullptr, usr->find_child("lib"));
+    usr->add_child({ "lib", 10 });
+    EXPECT_EQ(10, usr->find_child("lib")->get().value);
+  }
+
+  TEST(TreeNode, key_index_self_swap)
+  {
+    auto root = make_tree();
+    auto const usr = root.find_child("usr");
+    auto const lib = usr->find_child("lib");
+
+    DirTree::swap(lib, lib);
+    using std::swap;
+    swap(*lib, *lib);
+
+    lib->modify([](Entry& entry) { entry.name = "lib64"; });
+    EXPECT_EQ(nullptr, usr->find_child("lib"));
+    EXPECT_EQ(lib, usr->find_child("lib64"));
+
+    lib->remove();
+    EXPECT_EQ(nullptr, usr->find_child("lib64"));
+    EXPECT_EQ(nullptr, usr->find_child("lib"));
+  }
+
+  TEST(TreeNode, key_index_of_copies)
+  {
+    auto const root = make_tree();
+    auto const copied = root;
+    EXPECT_EQ(3, copied.resolve(vector<string>{ "usr", "bin", "ls" })->get().value);
+    EXPECT_NE(root.resolve(vector<string>{ "usr", "bin", "ls" }), copied.resolve(vector<string>{ "usr", "bin", "ls" }));
+
+    auto copied2 = copied;
+    auto const moved = std::move(copied2);
+    EXPECT_EQ(nullptr, copied2.find_child("usr"));
+    EXPECT_EQ(5, moved.resolve(vector<string>{ "usr", "lib" })->get().value);
+
+    vector<size_t> const parents = { size_t(-1), 0, 1, 0 };
+    vector<Entry> const entries = { { "", 0 }, { "a", 1 }, { "b", 2 }, { "c", 3 } };
+    auto const built = DirTree::build(parents.begin(), parents.end(), entries.begin());
+    EXPECT_EQ(2, built.resolve(vector<string>{ "a", "b" })->get().value);
+    EXPECT_EQ(3, built.find_child("c")->get().value);
+  }
+}
+
+
+
+namespace TreeNodeSiblingIndexTests
+{
+  using namespace std;
+  using IndexedNode = TreeNode<int, TreeNodePoolAllocator<int>, void, true>;
+
+  template<typename TNode>
+  void check_positions(TNode const& parent)
+  {
+    size_t i = 0;
+    for (auto child = parent.child_first(); child; child = child->next(), ++i)
+    {
+      EXPECT_EQ(child, parent.child_at(i));
+      EXPECT_EQ(i, parent.index_of(child));
+    }
+    EXPECT_EQ(i, parent.child_count());
+    EXPECT_EQ(nullptr, parent.child_at(i));
+  }
+
+  TEST(TreeNode, child_at_without_index)
+  {
+    TreeNode<int> root(0);
+    for (int i = 0; i < 10; ++i)
+      root.add_child(i);
+
+    EXPECT_EQ(10, root.child_count());
+    EXPECT_EQ(7, root.child_at(7)->get());
+    EXPECT_EQ(3, root.index_of(root.child_at(3)));
+    check_positions(root);
+  }
+
+  TEST(TreeNode, indexed_siblings_follow_mutations)
+  {
+    IndexedNode root(0);
+    vector<int> values(100);
+    iota(values.begin(), values.end(), 0);
+    root.add_children(values.begin(), values.end());
+    check_positions(root);
+    EXPECT_EQ(100, root.child_count());
+    EXPECT_EQ(42, root.child_at(42)->get());
+
+    root.push_front_child(-1);
+    root.insert_child_at(50, 1000);
+    root.child_at(10)->insert_after(1001);
+    root.child_at(20)->remove();
+    check_positions(root);
+    EXPECT_EQ(102, root.child_count());
+    EXPECT_EQ(1000, root.child_at(50)->get());
+
+    // Moved between parents
+    auto const other = root.child_at(5);
+    for (int i = 0; i < 10; ++i)
+      root.child_at(60)->move_to(other);
+
+    root.child_at(0)->move_after(root.child_at(30));
+    check_positions(root);
+    check_positions(*other);
+    EXPECT_EQ(92, root.child_count());
+    EXPECT_EQ(10, other->child_count());
+
+    auto part = other->detach();
+    check_positions(part);
+    root.child_at(3)->graft(std::move(part));
+    check_positions(*root.child_at(3));
+    check_positions(*root.child_at(3)->child_first());
+
+    root.sort_children(greater<int>());
+    check_positions(root);
+    EXPECT_EQ(1001, root.child_at(0)->get());
+
+    auto copied = root;
+    for (auto it = copied.begin_bfs<IndexedNode*>(); it != copied.end_bfs<IndexedNode*>(); ++it)
+      check_positions(**it);
+
+    root.clear();
+    EXPECT_EQ(0, root.child_count());
+    root.add_child(1);
+    check_positions(root);
+  }
+
+  TEST(TreeNode, indexed_siblings_large_random)
+  {
+    IndexedNode root(0);
+    vector<IndexedNode*> children;
+    uint32_t seed = 1;
+    for (int i = 0; i < 5000; ++i)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      auto const n = root.child_count();
+      if (n > 0 && seed % 4 == 0)
+        root.child_at((seed >> 8) % n)->remove();
+      else
+        root.insert_child_at(n > 0 ? (seed >> 8) % (n + 1) : 0, i);
+    }
+    check_positions(root);
+  }
+
+  TEST(TreeNode, segment_iterator_jumps)
+  {
+    IndexedNode root(0);
+    vector<int> values(1000);
+    iota(values.begin(), values.end(), 0);
+    root.add_children(values.begin(), values.end());
+
+    auto it = root.begin_segment();
+    it += 500;
+    EXPECT_EQ(500, *it);
+    it -= 250;
+    EXPECT_EQ(250, *it);
+    EXPECT_EQ(999, *(it + 749));
+    EXPECT_TRUE(it + 750 == root.end_segment());
+    EXPECT_EQ(0, *(it - 250));
+
+    // Binary search over the children
+    auto const begin = root.begin_segment();
+    size_t first = 0;
+    for (auto count = root.child_count(); count > 0; )
+    {
+      auto const step = count / 2;
+      auto it = begin + (first + step);
+      if (*it < 777)
+      {
+        first += step + 1;
+        count -= step + 1;
+      }
+      else
+        count = step;
+    }
+    EXPECT_EQ(777, *(begin + first));
+  }
+}
+
+
+
+namespace TreeNodeOrderStatisticsTests
+{
+  using namespace std;
+  using TN = TreeNode<int>;
+
+  TN make_random_tree(size_t n)
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(i < 50 ? 0 : ((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    return TN::build(parents.begin(), parents.end(), values.begin());
+  }
+
+  TEST(TreeNode, nth_dfs_and_dfs_index)
+  {
+    auto root = make_random_tree(2000);
+    vector<TN*> dfs;
+    copy(root.begin_dfs<TN*>(), root.end_dfs<TN*>(), back_inserter(dfs));
+
+    for (size_t k = 0; k < dfs.size(); ++k)
+    {
+      EXPECT_EQ(dfs[k], root.nth_dfs(k));
+      EXPECT_EQ(k, root.dfs_index(dfs[k]));
+    }
+    EXPECT_EQ(nullptr, root.nth_dfs(dfs.size()));
+
+    // From an inner node the order continues after its subtree
+    auto const node = dfs[700];
+    for (size_t k = 0; k + 700 < dfs.size(); k += 7)
+    {
+      EXPECT_EQ(dfs[700 + k], node->nth_dfs(k));
+      EXPECT_EQ(k, node->dfs_index(dfs[700 + k]));
+    }
+
+    for (size_t k = 0; k <= 700; k += 7)
+      EXPECT_EQ(dfs[700 - k], node->advance_dfs(-static_cast<ptrdiff_t>(k)));
+  }
+
+  TEST(TreeNode, nth_bfs_and_bfs_index)
+  {
+    auto root = make_random_tree(2000);
+    root.nth_dfs(300)->remove(); // unknown level widths
+    vector<TN*> bfs;
+    copy(root.begin_bfs<TN*>(), root.end_bfs<TN*>(), back_inserter(bfs));
+
+    for (size_t k = 0; k < bfs.size(); ++k)
+    {
+      EXPECT_EQ(bfs[k], root.nth_bfs(k));
+      EXPECT_EQ(k, root.bfs_index(bfs[k]));
+    }
+    EXPECT_EQ(nullptr, root.nth_bfs(bfs.size()));
+
+    auto const node = bfs[900];
+    for (size_t k = 0; k + 900 < bfs.size(); k += 3)
+      EXPECT_EQ(bfs[900 + k], node->nth_bfs(k));
+
+    for (size_t k = 0; k <= 900; k += 3)
+    {
+      EXPECT_EQ(bfs[900 - k], node->advance_bfs(-static_cast<ptrdiff_t>(k)));
+      EXPECT_EQ(k, bfs[900 - k]->bfs_index(node));
+    }
+  }
+
+  TEST(TreeNode, nth_bfs_concurrent_recount)
+  {
+    auto root = make_random_tree(2000);
+    vector<TN*> bfs;
+    copy(root.begin_bfs<TN*>(), root.end_bfs<TN*>(), back_inserter(bfs));
+
+    // The widths of the moved levels are unknown, they are recounted by the concurrent const queries
+    auto const moved = bfs[60];
+    moved->move_to(bfs[1]);
+    bfs.clear();
+    copy(root.begin_bfs<TN*>(), root.end_bfs<TN*>(), back_inserter(bfs));
+
+    TN const& croot = root;
+    vector<size_t> mismatch_nums(4);
+    vector<thread> threads;
+    for (size_t t = 0; t < mismatch_nums.size(); ++t)
+      threads.emplace_back([&, t]
+      {
+        for (size_t k = t; k < bfs.size(); k += 5)
+          mismatch_nums[t] += croot.nth_bfs(k) != bfs[k];
+      });
+
+    for (auto& thread : threads)
+      thread.join();
+
+    EXPECT_EQ(vector<size_t>(4, 0), mismatch_nums);
+    size_t n = 0;
+    for (size_t depth = 0; depth < root.get_height(); ++depth)
+      n += root.size_level(depth);
+    EXPECT_EQ(root.size(), n);
+  }
+
+  TEST(TreeNode, iterator_advance_dfs_bfs)
+  {
+    auto root = make_random_tree(5000);
+    vector<int> dfs(root.begin_dfs(), root.end_dfs());
+    vector<int> bfs(root.begin_bfs(), root.end_bfs());
+
+    // Pages of 100
+    for (size_t page = 0; page * 100 < dfs.size(); ++page)
+    {
+      auto it_dfs = root.begin_dfs();
+      it_dfs += page * 100;
+      EXPECT_EQ(dfs[page * 100], *it_dfs);
+
+      auto it_bfs = root.begin();
+      it_bfs += page * 100;
+      EXPECT_EQ(bfs[page * 100], *it_bfs);
+    }
+
+    auto it = root.begin_dfs() + 4000;
+    it -= 1234;
+    EXPECT_EQ(dfs[4000 - 1234], *it);
+    EXPECT_TRUE(root.begin_dfs() + dfs.size() == root.end_dfs());
+    EXPECT_TRUE(root.begin_bfs() + bfs.size() == root.end_bfs());
+    EXPECT_EQ(bfs[10], *(root.begin_bfs() + 4000 - 3990));
+  }
+}
+
+
+namespace TreeNodeDfsThreadTests
+{
+  using namespace std;
+  using TT = TreeNode<int, TreeNodePoolAllocator<int>, void, false, true>;
+
+  template<typename TNode>
+  TNode make_random_tree(size_t n)
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < n; ++i)
+    {
+      parents.push_back(i < 20 ? 0 : ((i * 2654435761u) >> 16) % i);
+      values.push_back(static_cast<int>(i));
+    }
+
+    return TNode::build(parents.begin(), parents.end(), values.begin());
+  }
+
+  // Dfs order by the sibling lists
+  template<typename TNode>
+  void collect_dfs(TNode const* node, vector<TNode const*>& nodes)
+  {
+    nodes.push_back(node);
+    for (auto child = node->child_first(); child; child = child->next())
+      collect_dfs(child, nodes);
+  }
+
+  void check_threads(TT const& root)
+  {
+    vector<TT const*> expected;
+    collect_dfs(&root, expected);
+
+    vector<TT const*> forward;
+    for (auto node = &root; node; node = node->next_dfs())
+      forward.push_back(node);
+
+    ASSERT_EQ(expected, forward);
+
+    vector<TT const*> backward;
+    for (auto node = expected.back(); node; node = node->prev_dfs())
+      backward.push_back(node);
+
+    reverse(backward.begin(), backward.end());
+    ASSERT_EQ(expected, backward);
+  }
+
+  TEST(TreeNode, dfs_threads_follow_mutations)
+  {
+    auto root = make_random_tree<TT>(500);
+    check_threads(root);
+
+    root.add_child(1000);
+    root.nth_dfs(17)->push_front_child(1001);
+    root.nth_dfs(250)->insert_child_at(0, 1002);
+    root.nth_dfs(40)->insert_after(1003);
+    vector<int> const values = { 1004, 1005, 1006 };
+    root.nth_dfs(99)->add_children(values.begin(), values.end());
+    check_threads(root);
+
+    root.nth_dfs(123)->remove();
+    root.nth_dfs(7)->remove();
+    check_threads(root);
+
+    root.nth_dfs(31)->move_to(root.nth_dfs(300));
+    root.nth_dfs(200)->move_before(root.nth_dfs(5));
+    root.nth_dfs(150)->move_after(root.child_last());
+    check_threads(root);
+
+    auto detached = root.nth_dfs(60)->detach();
+    check_threads(root);
+    check_threads(detached);
+
+    root.nth_dfs(10)->graft(move(detached));
+    check_threads(root);
+    check_threads(detached);
+
+    root.nth_dfs(77)->clear();
+    root.nth_dfs(3)->sort_children(greater<int>());
+    check_threads(root);
+
+    root.sort_all_segments(greater<int>());
+    check_threads(root);
+
+    auto const copied = root;
+    check_threads(copied);
+
+    auto moved = move(root);
+    check_threads(moved);
+
+    moved.clear();
+    check_threads(moved);
+  }
+
+  TEST(TreeNode, end_dfs_is_bounded_to_the_subtree)
+  {
+    auto root = make_random_tree<TT>(300);
+    auto root_plain = make_random_tree<TreeNode<int>>(300);
+    for (size_t k = 0; k < root.size(); k += 13)
+    {
+      auto const node = root.nth_dfs(k);
+      vector<int> const values(node->begin_dfs(), node->end_dfs());
+      vector<int> const values_plain(root_plain.nth_dfs(k)->begin_dfs(), root_plain.nth_dfs(k)->end_dfs());
+
+      vector<TT const*> expected;
+      collect_dfs<TT>(node, expected);
+      ASSERT_EQ(expected.size(), values.size());
+      for (size_t i = 0; i < values.size(); ++i)
+        EXPECT_EQ(expected[i]->get(), values[i]);
+
+      EXPECT_EQ(values, values_plain);
+    }
+
+    EXPECT_EQ(nullptr, root.end_dfs().node());
+    EXPECT_EQ(root.child_first()->next(), root.child_first()->end_dfs().node());
+  }
+
+  TEST(TreeNode, next_dfs_prev_dfs_without_threads)
+  {
+    auto const root = make_random_tree<TreeNode<int>>(300);
+    vector<TreeNode<int> const*> expected;
+    collect_dfs(&root, expected);
+
+    auto node = &root;
+    for (size_t i = 0; i < expected.size(); ++i, node = node->next_dfs())
+      EXPECT_EQ(expected[i], node);
+
+    EXPECT_EQ(nullptr, node);
+    EXPECT_EQ(nullptr, root.prev_dfs());
+    for (size_t i = 1; i < expected.size(); ++i)
+      EXPECT_EQ(expected[i - 1], expected[i]->prev_dfs());
+  }
+}
+
+
+namespace TreeNodeSubtreeRangeTests
+{
+  using namespace std;
+  using TN = TreeNode<int>;
+
+  vector<int> values_dfs(TN const& node)
+  {
+    vector<int> values = { node.get() };
+    for (auto child = node.child_first(); child; child = child->next())
+    {
+      auto const values_child = values_dfs(*child);
+      values.insert(values.end(), values_child.begin(), values_child.end());
+    }
+    return values;
+  }
+
+  vector<int> values_bfs(TN const& node)
+  {
+    vector<int> values;
+    vector<TN const*> nodes = { &node };
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+      values.push_back(nodes[i]->get());
+      for (auto child = nodes[i]->child_first(); child; child = child->next())
+        nodes.push_back(child);
+    }
+    return values;
+  }
+
+  TEST(TreeNode, subtree_dfs_and_bfs)
+  {
+    auto root = TreeNodeDfsThreadTests::make_random_tree<TN>(1000);
+    root.nth_dfs(500)->remove();
+    root.nth_dfs(100)->move_to(root.nth_dfs(700));
+
+    for (size_t k = 0; k < root.size(); k += 11)
+    {
+      auto const node = root.nth_dfs(k);
+
+      vector<int> dfs;
+      for (auto const v : node->subtree_dfs())
+        dfs.push_back(v);
+
+      EXPECT_EQ(values_dfs(*node), dfs);
+
+      vector<int> bfs;
+      for (auto const v : node->subtree_bfs())
+        bfs.push_back(v);
+
+      EXPECT_EQ(values_bfs(*node), bfs);
+    }
+  }
+
+  TEST(TreeNode, subtree_bfs_nodeptr_const)
+  {
+    TN root(0);
+    auto const n1 = root.add_child(1);
+    auto const n2 = root.add_child(2);
+    n1->add_child(11)->add_child(111);
+    n2->add_child(21)->add_child(211);
+    n2->add_child(22);
+    root.add_child(3)->add_child(31);
+
+    TN const& croot = root;
+    auto const range = croot.child_first()->next()->subtree_bfs<TN const*>();
+    vector<TN const*> nodes(range.begin(), range.end());
+    ASSERT_EQ(4, nodes.size());
+    EXPECT_EQ(n2, nodes[0]);
+    EXPECT_EQ(22, nodes[2]->get());
+    EXPECT_EQ(211, nodes[3]->get());
+
+    auto const leaf = root.child_last()->child_first();
+    EXPECT_EQ(vector<int>{ 31 }, vector<int>(leaf->subtree_bfs().begin(), leaf->subtree_bfs().end()));
+    EXPECT_EQ((vector<int>{ 0, 1, 2, 3, 11, 21, 22, 31, 111, 211 }), vector<int>(root.subtree_bfs().begin(), root.subtree_bfs().end()));
+  }
+}
+
+
+namespace TreeNodeVisitDfsTests
+{
+  using namespace std;
+  using TN = TreeNode<int>;
+
+  TN make_tree()
+  {
+    TN root(0);
+    auto const n1 = root.add_child(1);
+    n1->add_child(11)->add_child(111);
+    n1->add_child(12);
+    auto const n2 = root.add_child(2);
+    n2->add_child(21);
+    root.add_child(3)->add_child(31)->add_child(311);
+    return root;
+  }
+
+  TEST(TreeNode, visit_dfs_pre_post)
+  {
+    auto root = make_tree();
+    vector<int> pre, post;
+    EXPECT_TRUE(root.visit_dfs([&](TN& node) { pre.push_back(node.get()); return TN::DfsVisit::go_on; }, [&](TN& node) { post.push_back(node.get()); }));
+    EXPECT_EQ((vector<int>{ 0, 1, 11, 111, 12, 2, 21, 3, 31, 311 }), pre);
+    EXPECT_EQ((vector<int>{ 111, 11, 12, 1, 21, 2, 311, 31, 3, 0 }), post);
+
+    // Subtree of a node
+    pre.clear();
+    post.clear();
+    EXPECT_TRUE(root.child_first()->visit_dfs([&](TN& node) { pre.push_back(node.get()); return TN::DfsVisit::go_on; }, [&](TN& node) { post.push_back(node.get()); }));
+    EXPECT_EQ((vector<int>{ 1, 11, 111, 12 }), pre);
+    EXPECT_EQ((vector<int>{ 111, 11, 12, 1 }), post);
+  }
+
+  TEST(TreeNode, visit_dfs_skip_stop_max_depth)
+  {
+    auto const root = make_tree();
+    vector<int> pre, post;
+    auto const visit_pre = [&](TN const& node) { pre.push_back(node.get()); return node.get() == 1 || node.get() == 31 ? TN::DfsVisit::skip_subtree : TN::DfsVisit::go_on; };
+    EXPECT_TRUE(root.visit_dfs(visit_pre, [&](TN const& node) { post.push_back(node.get()); }));
+    EXPECT_EQ((vector<int>{ 0, 1, 2, 21, 3, 31 }), pre);
+    EXPECT_EQ((vector<int>{ 1, 21, 2, 31, 3, 0 }), post);
+
+    pre.clear();
+    post.clear();
+    EXPECT_FALSE(root.visit_dfs([&](TN const& node) { pre.push_back(node.get()); return node.get() == 12 ? TN::DfsVisit::stop : TN::DfsVisit::go_on; }, [&](TN const& node) { post.push_back(node.get()); }));
+    EXPECT_EQ((vector<int>{ 0, 1, 11, 111, 12 }), pre);
+    EXPECT_EQ((vector<int>{ 111, 11 }), post);
+
+    pre.clear();
+    EXPECT_TRUE(root.visit_dfs([&](TN const& node) { pre.push_back(node.get()); return TN::DfsVisit::go_on; }, [](TN const&) {}, 1));
+    EXPECT_EQ((vector<int>{ 0, 1, 2, 3 }), pre);
+  }
+
+  TEST(TreeNode, iterator_skip_subtree)
+  {
+    auto root = TreeNodeDfsThreadTests::make_random_tree<TN>(2000);
+
+    // The values grow along the paths (parent index < child index), the subtrees over the limit are pruned
+    vector<int> expected;
+    root.visit_dfs([&](TN const& node)
+    {
+      if (node.get() >= 300)
+        return TN::DfsVisit::skip_subtree;
+
+      expected.push_back(node.get());
+      return TN::DfsVisit::go_on;
+    });
+
+    vector<int> found;
+    for (auto it = root.begin_dfs(), end = root.end_dfs(); it != end; )
+    {
+      if (*it >= 300)
+        it.skip_subtree();
+      else
+        found.push_back(*it++);
+    }
+
+    EXPECT_EQ(expected, found);
+    EXPECT_EQ(300, found.size());
+  }
+}
+
+
+namespace TreeNodeParallelTests
+{
+  using namespace std;
+  using TN = TreeNode<int>;
+
+  TN make_chain(int n)
+  {
+    vector<int> parents(n), values(n);
+    for (int i = 0; i < n; ++i)
+    {
+      parents[i] = i - 1;
+      values[i] = i;
+    }
+
+    return TN::build(parents.begin(), parents.end(), values.begin());
+  }
+
+  TEST(TreeNode, tree_tasks_cover_the_tree)
+  {
+    for (auto root : { TreeNodeDfsThreadTests::make_random_tree<TN>(20000), make_chain(20000) })
+    {
+      auto const tasks = tree_tasks(root, 100);
+
+      vector<TN*> dfs;
+      copy(root.begin_dfs<TN*>(), root.end_dfs<TN*>(), back_inserter(dfs));
+      size_t position = 0;
+      for (auto const& task : tasks)
+      {
+        EXPECT_EQ(position, task.position); // consecutive dfs ranges
+        EXPECT_EQ(dfs[task.position], task.node);
+        EXPECT_LE(task.count, 100);
+        position += task.count;
+      }
+
+      EXPECT_EQ(dfs.size(), position);
+      EXPECT_LE(tasks.size(), dfs.size() / 20);
+    }
+  }
+
+  TEST(TreeNode, tree_for_each_par)
+  {
+    for (auto root : { TreeNodeDfsThreadTests::make_random_tree<TN>(100000), make_chain(50000) })
+    {
+      auto const n = root.size();
+      tree_for_each(execution::par, root, [](int& v) { v *= 2; });
+
+      auto const& croot = root;
+      atomic<long long> sum{ 0 };
+      tree_for_each(execution::par, croot, [&sum](int const& v) { sum += v; });
+      EXPECT_EQ(static_cast<long long>(n) * (n - 1), sum.load());
+    }
+  }
+
+  TEST(TreeNode, tree_transform_par)
+  {
+    for (auto const& root : { TreeNodeDfsThreadTests::make_random_tree<TN>(100000), make_chain(50000), TN{ 0, 1, 2, 3 } })
+    {
+      vector<int> expected;
+      for (auto const v : root.subtree_dfs())
+        expected.push_back(v + 1);
+
+      vector<int> values(root.size());
+      EXPECT_EQ(values.end(), tree_transform(execution::par, root, values.begin(), [](int v) { return v + 1; }));
+      EXPECT_EQ(expected, values);
+    }
+  }
+}
+
+
+namespace TreeNodeFoldUpTests
+{
+  using namespace std;
+  using TN = TreeNode<int>;
+
+  TEST(TreeNode, fold_up_subtree_sizes_and_max)
+  {
+    for (auto const& root : { TreeNodeDfsThreadTests::make_random_tree<TN>(100000), TreeNodeParallelTests::make_chain(100000), TN{ 5, 1, 9, 3 }, TN(7) })
+    {
+      vector<TN const*> dfs;
+      copy(root.begin_dfs<TN const*>(), root.end_dfs<TN const*>(), back_inserter(dfs));
+
+      vector<size_t> sizes(root.size());
+      EXPECT_EQ(root.size(), fold_up(execution::par, root, [](int) { return size_t(1); }, [](size_t l, size_t r) { return l + r; }, sizes.begin()));
+      for (size_t i = 0; i < dfs.size(); ++i)
+        ASSERT_EQ(dfs[i]->size(), sizes[i]);
+
+      // The expected maxima by one bottom-up pass: the descendants follow their ancestor in dfs order
+      unordered_map<TN const*, size_t> index;
+      vector<int> maxs_expected;
+      for (size_t i = 0; i < dfs.size(); ++i)
+      {
+        index.emplace(dfs[i], i);
+        maxs_expected.push_back(dfs[i]->get());
+      }
+
+      for (size_t i = dfs.size(); i-- > 1;)
+      {
+        auto& max_parent = maxs_expected[index.at(dfs[i]->parent())];
+        max_parent = max(max_parent, maxs_expected[i]);
+      }
+
+      vector<int> maxs(root.size());
+      fold_up(execution::seq, root, [](int v) { return v; }, [](int l, int r) { return max(l, r); }, maxs.begin());
+      EXPECT_EQ(maxs_expected, maxs);
+    }
+  }
+
+  TEST(TreeNode, fold_up_callback_in_child_order)
+  {
+    auto const root = TreeNodeDfsThreadTests::make_random_tree<TN>(20000);
+    vector<size_t> heights(root.size());
+    mutex m;
+    map<TN const*, string> paths;
+    auto const path = fold_up(execution::par, root, [](int v) { return to_string(v); }, [](string l, string const& r) { return l + "(" + r + ")"; }, [&](TN const& node, string const& result)
+    {
+      lock_guard<mutex> lock(m);
+      paths[&node] = result;
+    });
+
+    ASSERT_EQ(root.size(), paths.size());
+    EXPECT_EQ(paths[&root], path);
+
+    // Children in sibling order: the path of a node is its value followed by its children's paths
+    for (auto const& [node, result] : paths)
+    {
+      auto expected = to_string(node->get());
+      for (auto child = node->child_first(); child; child = child->next())
+        expected += "(" + paths[child] + ")";
+
+      ASSERT_EQ(expected, result);
+    }
+  }
+}
+
+
+namespace TreeNodeAggregateTests
+{
+  using namespace std;
+
+  struct Item
+  {
+    string name;
+    int64_t weight = 0;
+  };
+
+  struct NameOf
+  {
+    string const& operator()(Item const& item) const noexcept { return item.name; }
+  };
+
+  // Group: removals and value changes are O(depth)
+  struct SumOfWeight
+  {
+    int64_t of(Item const& item) const noexcept { return item.weight; }
+    int64_t combine(int64_t l, int64_t r) const noexcept { return l + r; }
+    int64_t subtract(int64_t total, int64_t part) const noexcept { return total - part; }
+  };
+
+  // Monoid only: the ancestors are recombined
+  struct MaxOfWeight
+  {
+    int64_t of(Item const& item) const noexcept { return item.weight; }
+    int64_t combine(int64_t l, int64_t r) const noexcept { return max(l, r); }
+  };
+
+  template<typename TNode, typename TCombine>
+  void check_aggregates(TNode const& root, TCombine combine)
+  {
+    for (auto it = root.template begin_dfs<TNode const*>(); it != root.template end_dfs<TNode const*>(); ++it)
+    {
+      auto const node = *it;
+      auto expected = node->get().weight;
+      for (auto const& item : TreeNodeRange<decltype(it)>{ next(node->template begin_dfs<TNode const*>()), node->template end_dfs<TNode const*>() })
+        expected = combine(expected, item->get().weight);
+
+      ASSERT_EQ(expected, node->aggregate());
+    }
+  }
+
+  template<typename TAggregate, typename TCombine>
+  void mutate_and_check(TCombine combine)
+  {
+    using TN = TreeNode<Item, TreeNodePoolAllocator<Item>, NameOf, false, false, TAggregate>;
+
+    vector<size_t> parents = { size_t(-1) };
+    vector<Item> items = { { "0", 1 } };
+    for (size_t i = 1; i < 300; ++i)
+    {
+      parents.push_back(i < 10 ? 0 : ((i * 2654435761u) >> 16) % i);
+      items.push_back({ to_string(i), static_cast<int64_t>((i * 7919) % 1000) });
+    }
+
+    auto root = TN::build(parents.begin(), parents.end(), items.begin());
+    check_aggregates(root, combine);
+
+    root.add_child({ "a", 5000 });
+    root.nth_dfs(17)->push_front_child({ "b", 3000 });
+    root.nth_dfs(40)->insert_after({ "c", -20 });
+    vector<Item> const run = { { "d", 4000 }, { "e", 1 }, { "f", 6000 } };
+    root.nth_dfs(99)->add_children(run.begin(), run.end());
+    check_aggregates(root, combine);
+
+    root.find_child("a")->remove();
+    root.nth_dfs(123)->remove();
+    root.nth_dfs(60)->clear();
+    check_aggregates(root, combine);
+
+    root.nth_dfs(31)->move_to(root.nth_dfs(200));
+    root.nth_dfs(150)->move_before(root.nth_dfs(5));
+    check_aggregates(root, combine);
+
+    auto detached = root.nth_dfs(20)->detach();
+    check_aggregates(root, combine);
+    check_aggregates(detached, combine);
+
+    root.nth_dfs(10)->graft(std::move(detached));
+    check_aggregates(root, combine);
+
+    auto const node = root.nth_dfs(77);
+    auto const name = node->get().name;
+    node->modify([](Item& item) { item.weight = 9000; item.name = "modified"; });
+    EXPECT_EQ(node, node->parent()->find_child("modified"));
+    EXPECT_EQ(nullptr, node->parent()->find_child(name));
+    TN::modify(root.nth_dfs(3), [](Item& item) { item.weight = -5; });
+    TN::swap(root.nth_dfs(5), root.nth_dfs(250));
+    check_aggregates(root, combine);
+
+    root.sort_all_segments([](Item const& l, Item const& r) { return l.weight < r.weight; });
+    auto const copied = root;
+    check_aggregates(copied, combine);
+
+    auto moved = std::move(root);
+    check_aggregates(moved, combine);
+    moved.clear();
+    EXPECT_EQ(moved.get().weight, moved.aggregate());
+  }
+
+  TEST(TreeNode, aggregate_sum_follows_mutations)
+  {
+    mutate_and_check<SumOfWeight>([](int64_t l, int64_t r) { return l + r; });
+  }
+
+  TEST(TreeNode, aggregate_max_follows_mutations)
+  {
+    mutate_and_check<MaxOfWeight>([](int64_t l, int64_t r) { return max(l, r); });
+  }
+
+  TEST(TreeNode, aggregate_of_single_nodes)
+  {
+    using TN = TreeNode<Item, TreeNodePoolAllocator<Item>, void, false, false, SumOfWeight>;
+    TN root(Item{ "root", 2 });
+    EXPECT_EQ(2, root.aggregate());
+
+    auto const child = root.emplace_child(Item{ "child", 3 });
+    child->add_child({ "leaf", 4 });
+    EXPECT_EQ(9, root.aggregate());
+    EXPECT_EQ(7, child->aggregate());
+
+    TN const list = { { "", 1 }, { "", 10 }, { "", 100 } };
+    EXPECT_EQ(111, list.aggregate());
+  }
+}
+
+
+namespace TreeNodeBatchUpdateTests
+{
+  using namespace std;
+  using TreeNodeAggregateTests::Item;
+  using TreeNodeAggregateTests::SumOfWeight;
+  using TreeNodeAggregateTests::MaxOfWeight;
+
+  template<typename TNode>
+  void check_sizes(TNode const& root)
+  {
+    vector<TNode const*> nodes;
+    TreeNodeDfsThreadTests::collect_dfs(&root, nodes);
+    for (size_t i = nodes.size(); i > 0; --i)
+    {
+      auto const node = nodes[i - 1];
+      size_t n = 1;
+      for (auto child = node->child_first(); child; child = child->next())
+        n += child->size();
+
+      ASSERT_EQ(n, node->size());
+    }
+  }
+
+  TEST(TreeNode, batch_update_deferred_sizes)
+  {
+    using TN = TreeNode<int>;
+    auto root = TreeNodeParallelTests::make_chain(1000);
+    auto const deep = root.nth_dfs(999);
+    auto const middle = root.nth_dfs(500);
+    {
+      TN::batch_update batch;
+      for (int i = 0; i < 1000; ++i)
+        deep->add_child(i);
+
+      vector<int> const values = { 1, 2, 3 };
+      middle->add_children(values.begin(), values.end());
+      root.add_child(7)->add_child(8);
+
+      {
+        TN::batch_update nested;
+        middle->push_front_child(9);
+      }
+
+      EXPECT_EQ(2006, root.size()); // the query applies the pending growth
+      root.add_child(10);
+      EXPECT_EQ(deep, root.nth_dfs(1000)); // after the front child of middle
+      deep->child_first()->remove();
+      EXPECT_EQ(2006, root.size());
+    }
+
+    EXPECT_EQ(2006, root.size());
+    EXPECT_EQ(1000, deep->size());
+    check_sizes(root);
+  }
+
+  template<typename TAggregate, typename TCombine>
+  void batch_and_check(TCombine combine)
+  {
+    using TN = TreeNode<Item, TreeNodePoolAllocator<Item>, void, false, false, TAggregate>;
+    vector<size_t> parents = { size_t(-1) };
+    vector<Item> items = { { "0", 1 } };
+    for (size_t i = 1; i < 300; ++i)
+    {
+      parents.push_back(i < 10 ? 0 : ((i * 2654435761u) >> 16) % i);
+      items.push_back({ to_string(i), static_cast<int64_t>((i * 7919) % 1000) });
+    }
+
+    auto root = TN::build(parents.begin(), parents.end(), items.begin());
+    {
+      typename TN::batch_update batch;
+      for (size_t i = 0; i < 500; ++i)
+      {
+        TN* node = &root;
+        for (size_t k = 0; k < i % 7 && node->child_last(); ++k)
+          node = node->child_last();
+
+        node->add_child({ "new", static_cast<int64_t>(i * 31 % 5000) });
+        if (i % 100 == 99)
+          root.nth_dfs(i)->modify([](Item& item) { item.weight += 3; });
+      }
+    }
+
+    check_sizes(root);
+    TreeNodeAggregateTests::check_aggregates(root, combine);
+  }
+
+  TEST(TreeNode, batch_update_deferred_aggregates)
+  {
+    batch_and_check<SumOfWeight>([](int64_t l, int64_t r) { return l + r; });
+    batch_and_check<MaxOfWeight>([](int64_t l, int64_t r) { return max(l, r); });
+  }
+
+  TEST(TreeNode, batch_update_failed_insertion_not_counted)
+  {
+    using TreeNodeKeyIndexTests::Entry;
+    using CheckedTree = TreeNode<Entry, TreeNodePoolAllocator<Entry>, TreeNodeKeyIndexTests::CheckedNameOf>;
+    CheckedTree root(Entry{ "", 0 });
+    auto const usr = root.add_child({ "usr", 1 });
+    {
+      CheckedTree::batch_update batch;
+      usr->add_child({ "bin", 2 });
+      EXPECT_THROW(usr->add_child({ "!", 3 }), invalid_argument);
+      EXPECT_THROW(root.add_child({ "!", 4 }), invalid_argument); // root is not marked yet
+      usr->add_child({ "lib", 5 });
+    }
+
+    EXPECT_EQ(4, root.size());
+    EXPECT_EQ(3, usr->size());
+    check_sizes(root);
+  }
+}
+
+
+namespace TreeNodeAncestryTests
+{
+  using namespace std;
+  using TL = TreeNode<int, TreeNodePoolAllocator<int>, void, false, false, void, true>;
+
+  template<typename TNode>
+  bool is_ancestor_naive(TNode const* node, TNode const* descendant)
+  {
+    for (; descendant; descendant = descendant->parent())
+      if (descendant == node)
+        return true;
+
+    return false;
+  }
+
+  template<typename TNode>
+  TNode const* lca_naive(TNode const* a, TNode const* b)
+  {
+    for (; a; a = a->parent())
+      if (is_ancestor_naive(a, b))
+        return a;
+
+    return nullptr;
+  }
+
+  template<typename TNode>
+  void check_ancestry(TNode const& root)
+  {
+    vector<TNode const*> nodes;
+    TreeNodeDfsThreadTests::collect_dfs(&root, nodes);
+    for (auto const a : nodes)
+      for (auto const b : nodes)
+        ASSERT_EQ(is_ancestor_naive(a, b), a->is_ancestor_of(b));
+
+    for (size_t i = 0; i < 2000; ++i)
+    {
+      auto const a = nodes[(i * 2654435761u) % nodes.size()];
+      auto const b = nodes[(i * 40503u + 7) % nodes.size()];
+      ASSERT_EQ(lca_naive(a, b), TNode::lowest_common_ancestor(a, b));
+    }
+  }
+
+  template<typename TNode>
+  void mutate_and_check()
+  {
+    auto root = TreeNodeDfsThreadTests::make_random_tree<TNode>(300);
+    check_ancestry(root);
+
+    // The same gaps are split until the labels are redistributed
+    auto const node = root.nth_dfs(17);
+    for (int i = 0; i < 500; ++i)
+    {
+      node->push_front_child(i);
+      node->child_last()->insert_before(i);
+    }
+    root.nth_dfs(40)->insert_after(1003);
+    vector<int> const values = { 1004, 1005, 1006 };
+    root.nth_dfs(99)->add_children(values.begin(), values.end());
+    check_ancestry(root);
+
+    root.nth_dfs(123)->remove();
+    root.nth_dfs(600)->clear();
+    check_ancestry(root);
+
+    root.nth_dfs(31)->move_to(root.nth_dfs(900));
+    root.nth_dfs(200)->move_before(root.nth_dfs(5));
+    check_ancestry(root);
+
+    auto detached = root.nth_dfs(20)->detach();
+    check_ancestry(root);
+    check_ancestry(detached);
+
+    root.nth_dfs(700)->graft(std::move(detached));
+    root.sort_all_segments(greater<int>());
+    root.nth_dfs(50)->sort_children();
+    check_ancestry(root);
+
+    auto const copied = root;
+    check_ancestry(copied);
+    auto moved = std::move(root);
+    check_ancestry(moved);
+  }
+
+  TEST(TreeNode, ancestry_labels_follow_mutations)
+  {
+    mutate_and_check<TL>();
+  }
+
+  TEST(TreeNode, ancestry_walk_without_labels)
+  {
+    mutate_and_check<TreeNode<int>>();
+  }
+
+  TEST(TreeNode, lowest_common_ancestor_on_a_deep_chain)
+  {
+    vector<size_t> parents = { size_t(-1) };
+    vector<int> values = { 0 };
+    for (size_t i = 1; i < 100000; ++i)
+    {
+      parents.push_back(i - 1);
+      values.push_back(static_cast<int>(i));
+    }
+
+    auto root = TL::build(parents.begin(), parents.end(), values.begin());
+    auto const deep = root.nth_dfs(99999);
+    auto const middle = root.nth_dfs(50000);
+    auto const branch = middle->add_child(-1)->add_child(-2);
+    EXPECT_EQ(middle, TL::lowest_common_ancestor(deep, branch));
+    EXPECT_EQ(middle, TL::lowest_common_ancestor(branch, deep));
+    EXPECT_EQ(deep, TL::lowest_common_ancestor(deep, deep));
+    EXPECT_TRUE(root.is_ancestor_of(branch));
+    EXPECT_TRUE(middle->is_ancestor_of(deep));
+    EXPECT_FALSE(deep->is_ancestor_of(middle));
+    EXPECT_FALSE(branch->is_ancestor_of(deep));
+  }
+}